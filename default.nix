@@ -6,5 +6,5 @@
 pkgs.stdenv.mkDerivation {
   src = builtins.filterSource (path: type: type != "directory" || baseNameOf path != "build") ./.;
   name = "xkb-switch-env";
-  buildInputs = (with pkgs; with xorg; [ cmake libX11 libxkbfile ]);
+  buildInputs = (with pkgs; with xorg; [ cmake libX11 libxcb libXi ]);
 }
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Implementation of the event recording and replay */
+
+#include <cstdlib>
+#include <sstream>
+
+#include "EventLog.hpp"
+#include "XBackend.hpp"
+#include "Utils.hpp"
+
+using namespace std;
+
+namespace kb {
+
+namespace {
+
+const char log_header[] = "xkb-switch-events 1";
+
+const char* kind_name(event_kind kind)
+{
+  switch(kind) {
+    case EVENT_STATE:  return "state";
+    case EVENT_NAMES:  return "names";
+    case EVENT_KEYMAP: return "keymap";
+    case EVENT_RULES:  return "rules";
+    default:           return "init";
+  }
+}
+
+// Tabs and newlines would break the fields
+string field(const string& str)
+{
+  string out(str);
+  for(size_t i=0; i<out.size(); i++) {
+    if(out[i] == '\t' || out[i] == '\n')
+      out[i] = ' ';
+  }
+  return out;
+}
+
+void write_event(ostream& log, event_kind kind, Time time, const xkb_query& q)
+{
+  log << kind_name(kind) << '\t' << time << '\t' << q.group;
+  if(kind != EVENT_STATE) {
+    log << '\t' << field(q.lv.first) << '\t' << field(q.lv.second);
+    for(size_t i=0; i<q.names.size(); i++)
+      log << '\t' << field(q.names[i]);
+  }
+  log << '\n';
+}
+
+void record_event(const XKeyboard& xkb, const XEvent& event, event_kind kind, void* arg)
+{
+  ostream& log = *static_cast<ostream*>(arg);
+  if(kind == EVENT_STATE) {
+    const XkbEvent& xkbEvent = reinterpret_cast<const XkbEvent&>(event);
+    // Groups of other devices are not recorded
+    if(!xkb.devices().empty() && static_cast<int>(xkbEvent.any.device) != xkb._deviceId)
+      return;
+    xkb_query q(QUERY_GROUP);
+    q.group = xkbEvent.state.group;
+    write_event(log, kind, xkb.event_time(), q);
+  }
+  else {
+    // The replay needs the names valid after the event
+    xkb_query q(QUERY_GROUP | QUERY_RULES | QUERY_NAMES);
+    xkb.run_query(q, STAT_QUERY);
+    write_event(log, kind, xkb.event_time(), q);
+  }
+  log.flush();
+}
+
+event_kind parse_kind(const string& str, size_t verbose)
+{
+  if(str == "init")
+    return EVENT_NONE;
+  if(str == "state")
+    return EVENT_STATE;
+  if(str == "names")
+    return EVENT_NAMES;
+  if(str == "keymap")
+    return EVENT_KEYMAP;
+  if(str == "rules")
+    return EVENT_RULES;
+  THROW_MSG(verbose, "Unknown event kind '" << str << "'");
+}
+
+}
+
+void record_groups(XKeyboard& xkb, ostream& log, stream_format format,
+                   int fancy, Writer& out, stream_hook hook)
+{
+  xkb.enable_cache();
+  xkb_query q(QUERY_GROUP | QUERY_RULES | QUERY_NAMES);
+  xkb.run_query(q, STAT_QUERY);
+  log << log_header << '\n';
+  write_event(log, EVENT_NONE, CurrentTime, q);
+  log.flush();
+  CHECK_MSG(xkb._verbose, log, "Failed to write the event log");
+
+  xkb.set_observer(record_event, &log);
+  try {
+    stream_groups(xkb, format, fancy, out, hook);
+  }
+  catch(...) {
+    xkb.set_observer(NULL, NULL);
+    throw;
+  }
+}
+
+void read_event_log(istream& in, event_log& log, size_t verbose)
+{
+  string line;
+  getline(in, line);
+  CHECK_MSG(verbose, in && line == log_header, "Not an xkb-switch event log");
+
+  log.clear();
+  size_t lineno = 1;
+  while(getline(in, line)) {
+    lineno++;
+    if(line.empty())
+      continue;
+
+    string_vector fields;
+    size_t start = 0;
+    while(true) {
+      size_t tab = line.find('\t', start);
+      fields.push_back(line.substr(start, tab == string::npos ? string::npos : tab - start));
+      if(tab == string::npos)
+        break;
+      start = tab + 1;
+    }
+
+    recorded_event e;
+    CHECK_MSG(verbose, fields.size() >= 3, "Invalid event at line " << lineno);
+    e.kind = parse_kind(fields[0], verbose);
+    e.time = strtoul(fields[1].c_str(), NULL, 10);
+    e.group = atoi(fields[2].c_str());
+    if(e.kind != EVENT_STATE) {
+      CHECK_MSG(verbose, fields.size() >= 5, "Invalid event at line " << lineno);
+      e.lv = make_pair(fields[3], fields[4]);
+      e.names.assign(fields.begin() + 5, fields.end());
+    }
+    CHECK_MSG(verbose, (e.kind == EVENT_NONE) == log.empty(),
+        "The initial state must be the first event, line " << lineno);
+    log.push_back(e);
+  }
+  CHECK_MSG(verbose, !log.empty(), "The event log has no initial state");
+}
+
+}
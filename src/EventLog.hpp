@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Recording of keyboard event streams, see replay_events() for the replay
+ *
+ * A log is a text file starting with the line "xkb-switch-events 1",
+ * followed by a line per event with tab-separated fields:
+ *
+ *   KIND TIME GROUP [LAYOUT VARIANT NAME...]
+ *
+ * KIND is init (the state at the start), state, names, keymap or rules. All
+ * kinds but state carry the layout and variant strings of the rules property
+ * and the fancy group names valid after the event.
+ */
+
+#ifndef EVENTLOG_HPP
+#define EVENTLOG_HPP
+
+#include <iostream>
+#include <vector>
+
+#include "XKeyboard.hpp"
+#include "Stream.hpp"
+#include "Writer.hpp"
+
+namespace kb {
+
+// Keyboard event of a log, EVENT_NONE for the initial state
+struct recorded_event {
+  event_kind kind;
+  Time time;
+  int group;
+  layout_variant_strings lv;
+  string_vector names;
+};
+
+typedef std::vector<recorded_event> event_log;
+
+// Streams the groups like stream_groups() and appends every keyboard event
+// to the log. Never returns.
+void record_groups(XKeyboard& xkb, std::ostream& log, stream_format format,
+                   int fancy, Writer& out, stream_hook hook = NULL);
+
+// Reads a log written by record_groups() (or throw std::runtime_error)
+void read_event_log(std::istream& in, event_log& log, size_t verbose);
+
+}
+
+#endif
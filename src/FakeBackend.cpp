@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Implementation of the simulated XKB backend and the event replay */
+
+#include <cstring>
+
+#include "FakeBackend.hpp"
+#include "Utils.hpp"
+
+namespace kb {
+
+FakeBackend::FakeBackend()
+  : _group(0), _lv("us", ""), _queries(0)
+{
+  _history.count = 0;
+}
+
+void FakeBackend::query(xkb_query& q)
+{
+  _queries++;
+  q.round_trips++;
+  if(q.mask & QUERY_GROUP) {
+    q.requests++;
+    q.group = _group;
+  }
+  if(q.mask & QUERY_RULES) {
+    q.requests++;
+    q.lv = _lv;
+  }
+  if(q.mask & QUERY_NAMES) {
+    q.requests++;
+    q.names = _names;
+  }
+  if(q.mask & QUERY_HISTORY) {
+    q.requests++;
+    q.history = _history;
+  }
+}
+
+XEvent make_event(const XKeyboard& xkb, event_kind kind, Time time, int group)
+{
+  XEvent event;
+  std::memset(&event, 0, sizeof(event));
+
+  if(kind == EVENT_RULES) {
+    event.xproperty.type = PropertyNotify;
+    event.xproperty.atom = xkb.rules_atom();
+    event.xproperty.time = time;
+    event.xproperty.state = PropertyNewValue;
+    return event;
+  }
+
+  XkbEvent& xkbEvent = reinterpret_cast<XkbEvent&>(event);
+  xkbEvent.any.type = xkb._eventBase;
+  xkbEvent.any.time = time;
+  xkbEvent.any.device = xkb._deviceId;
+  switch(kind) {
+    case EVENT_STATE:
+      xkbEvent.any.xkb_type = XkbStateNotify;
+      xkbEvent.state.group = group;
+      xkbEvent.state.locked_group = group;
+      xkbEvent.state.changed = XkbGroupStateMask;
+      break;
+    case EVENT_NAMES:
+      xkbEvent.any.xkb_type = XkbNamesNotify;
+      xkbEvent.names.changed = XkbGroupNamesMask;
+      break;
+    case EVENT_KEYMAP:
+      xkbEvent.any.xkb_type = XkbNewKeyboardNotify;
+      break;
+    default:
+      THROW_MSG(xkb._verbose, "No event of kind " << kind);
+  }
+  return event;
+}
+
+size_t replay_events(const event_log& log, stream_format format, int fancy,
+                     Writer& out, size_t verbose)
+{
+  CHECK_MSG(verbose, !log.empty() && log[0].kind == EVENT_NONE,
+      "The event log has no initial state");
+
+  FakeBackend* fake = new FakeBackend();
+  fake->_group = log[0].group;
+  fake->_lv = log[0].lv;
+  fake->_names = log[0].names;
+
+  XKeyboard xkb(verbose);
+  xkb.open_backend(fake);
+
+  GroupStream stream(format, fancy, "", "", verbose);
+  stream.update(xkb, xkb.get_group(), out);
+  for(size_t i=1; i<log.size(); i++) {
+    const recorded_event& e = log[i];
+    fake->_group = e.group;
+    if(e.kind != EVENT_STATE) {
+      fake->_lv = e.lv;
+      fake->_names = e.names;
+    }
+    xkb.handle_event(make_event(xkb, e.kind, e.time, e.group));
+    stream.update(xkb, xkb.get_group(), out);
+  }
+  return log.size() - 1;
+}
+
+}
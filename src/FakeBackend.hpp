@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Simulated XKB backend for tests and benchmarks without an X server */
+
+#ifndef FAKEBACKEND_HPP
+#define FAKEBACKEND_HPP
+
+#include "XBackend.hpp"
+#include "EventLog.hpp"
+
+namespace kb {
+
+// Answers queries from its members, which the caller changes at will. Pair
+// with XKeyboard::open_backend() and inject events made by make_event().
+class FakeBackend : public XBackend
+{
+public:
+  int _group;
+  layout_variant_strings _lv;   // Layout and variant strings of the rules
+  string_vector _names;         // Fancy group names
+  group_history _history;       // Most recently used groups
+  unsigned long _queries;       // Number of queries answered
+
+  FakeBackend();
+
+  // Counts every item as a request, the whole query as one round trip
+  void query(xkb_query& q);
+};
+
+// Returns the event the X server would send for the change of the kind.
+// The group is used by EVENT_STATE only.
+XEvent make_event(const XKeyboard& xkb, event_kind kind, Time time, int group = 0);
+
+// Feeds the log to a keyboard with a FakeBackend as fast as possible and
+// streams the groups like stream_groups(). Returns the number of events.
+size_t replay_events(const event_log& log, stream_format format, int fancy,
+                     Writer& out, size_t verbose);
+
+}
+
+#endif
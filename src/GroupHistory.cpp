@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Implementation of the shared group history */
+
+#include <algorithm>
+
+#include "GroupHistory.hpp"
+#include "Utils.hpp"
+
+using namespace std;
+
+namespace kb {
+
+GroupHistory::GroupHistory(XKeyboard& xkb)
+  : _xkb(xkb), _target(-1)
+{
+  CHECK(xkb._verbose, xkb._display != 0);
+}
+
+void GroupHistory::read(vector<int>& groups, int count)
+{
+  const group_history& history = _xkb.history();
+  groups.clear();
+  for(int i=0; i<history.count; i++) {
+    if(history.groups[i] < count)
+      groups.push_back(history.groups[i]);
+  }
+}
+
+group_change GroupHistory::toggle(int primary, int timeout_ms)
+{
+  return select(primary, 1, timeout_ms);
+}
+
+group_change GroupHistory::recent(int n, int timeout_ms)
+{
+  return select(-1, n, timeout_ms);
+}
+
+group_change GroupHistory::select(int primary, int n, int timeout_ms)
+{
+  size_t verbose = _xkb._verbose;
+  Display* display = _xkb._display;
+  int count = _xkb.layout_table().size();
+  CHECK_MSG(verbose, count > 0, "No layout groups configured");
+  CHECK_MSG(verbose, n > 0, "Invalid history position " << n);
+  _xkb.select_state_events();
+
+  XGrabServer(display);
+  vector<int> groups;
+  group_change change;
+  try {
+    // The group may have been switched by other means since the last update
+    _xkb.prefetch(QUERY_GROUP | QUERY_HISTORY);
+    int current = _xkb.get_group();
+    read(groups, count);
+    groups.erase(remove(groups.begin(), groups.end(), current), groups.end());
+    groups.insert(groups.begin(), current);
+
+    int target;
+    if(primary >= 0 && primary != current) {
+      target = primary;
+    }
+    else if(n < static_cast<int>(groups.size())) {
+      target = groups[n];
+    }
+    else {
+      // Not enough history yet, go through the groups in order
+      target = (current + n) % count;
+    }
+    _target = target;
+    MSG(verbose, "History has " << groups.size() << " groups, current " << current
+        << ", switching to " << target);
+
+    change.group = target;
+    change.time = CurrentTime;
+    change.confirmed = true;
+    if(target != current) {
+      _xkb.lock_group(target, false);
+    }
+    _xkb.record_group(current, target);
+    XUngrabServer(display);
+    XFlush(display);
+    if(target != current) {
+      change = _xkb.confirm_group(target, timeout_ms);
+    }
+  }
+  catch(...) {
+    XUngrabServer(display);
+    XFlush(display);
+    throw;
+  }
+  return change;
+}
+
+}
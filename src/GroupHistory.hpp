@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** History of the most recently used layout groups, shared by invocations */
+
+#ifndef GROUPHISTORY_HPP
+#define GROUPHISTORY_HPP
+
+#include <vector>
+
+#include "XKeyboard.hpp"
+
+namespace kb {
+
+// Most recently used groups, kept in the _XKB_SWITCH_MRU root window
+// property as a CARDINAL list, the current group first. Plain switches
+// record themselves, see XKeyboard::set_group(). The switches choosing their
+// group from the history read the property, lock the group and write the
+// property back under a server grab, so concurrent invocations don't lose
+// updates.
+class GroupHistory
+{
+public:
+  XKeyboard& _xkb;
+  int _target;  // Group chosen by the last switch
+
+  GroupHistory(XKeyboard& xkb);
+
+  // Switches to the primary group, or to the most recently used other group
+  // if the primary one is current. Without a primary group (-1) toggles
+  // between the two most recently used groups.
+  group_change toggle(int primary, int timeout_ms);
+
+  // Switches to the n-th most recently used group other than the current
+  // one, 1 being the previous group
+  group_change recent(int n, int timeout_ms);
+
+  // Reads the history, the current group first. Groups that are no longer
+  // configured are dropped.
+  void read(std::vector<int>& groups, int count);
+
+private:
+  group_change select(int primary, int n, int timeout_ms);
+};
+
+}
+
+#endif
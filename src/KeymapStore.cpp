@@ -0,0 +1,299 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Implementation of the switching to layouts outside of the loaded groups */
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <vector>
+
+#include <X11/Xatom.h>
+#include <X11/XKBlib.h>
+
+#include "KeymapStore.hpp"
+#include "XBackend.hpp"
+#include "GroupHistory.hpp"
+#include "Utils.hpp"
+
+using namespace std;
+
+namespace kb {
+
+namespace {
+
+vector<string> split(const string& str, char sep)
+{
+  vector<string> out;
+  size_t start = 0;
+  while(true) {
+    size_t end = str.find(sep, start);
+    out.push_back(str.substr(start, end == string::npos ? string::npos : end - start));
+    if(end == string::npos)
+      break;
+    start = end + 1;
+  }
+  return out;
+}
+
+string join(const vector<string>& items, char sep)
+{
+  string out;
+  for(size_t i=0; i<items.size(); i++) {
+    if(i > 0)
+      out += sep;
+    out += items[i];
+  }
+  return out;
+}
+
+bool valid_name(const string& str)
+{
+  if(str.empty())
+    return false;
+  for(size_t i=0; i<str.size(); i++) {
+    char c = str[i];
+    if(!isalnum(static_cast<unsigned char>(c)) && c != '_' && c != '-' && c != '.')
+      return false;
+  }
+  return true;
+}
+
+// Returns the symbols of a group as they appear in the symbols component
+string group_symbols(const string& layout, const string& variant, int group)
+{
+  string out = layout;
+  if(!variant.empty())
+    out += "(" + variant + ")";
+  if(group > 0)
+    out += ":" + to_string(group + 1);
+  return out;
+}
+
+// Returns the part of the symbols component holding the group, or -1
+int find_group_symbols(const vector<string>& parts, const string& layout,
+                       const string& variant, int group)
+{
+  string sym = group_symbols(layout, variant, group);
+  for(size_t i=0; i<parts.size(); i++) {
+    if(parts[i] == sym || (group == 0 && parts[i] == sym + ":1"))
+      return i;
+  }
+  return -1;
+}
+
+// Returns the index in the layout table of every layout field, -1 for the
+// empty ones, which LayoutTable skips
+vector<int> table_indices(const vector<string>& layouts)
+{
+  vector<int> out(layouts.size(), -1);
+  int next = 0;
+  for(size_t i=0; i<layouts.size(); i++) {
+    if(!layouts[i].empty())
+      out[i] = next++;
+  }
+  return out;
+}
+
+// Returns the number of groups of a keymap, the most any of its keys has
+int keymap_groups(XkbDescPtr desc)
+{
+  int groups = 0;
+  if(desc != NULL && desc->map != NULL && desc->map->key_sym_map != NULL) {
+    for(int kc = desc->min_key_code; kc <= desc->max_key_code; kc++)
+      groups = max<int>(groups, XkbKeyNumGroups(desc, kc));
+  }
+  return groups;
+}
+
+}
+
+KeymapStore::KeymapStore(XKeyboard& xkb)
+  : _xkb(xkb)
+{
+}
+
+void KeymapStore::read_components(keymap_components& kc)
+{
+  Display* display = _xkb._display;
+  XkbDescRec* desc = _xkb._kbdDescPtr;
+  unsigned int mask = XkbKeycodesNameMask | XkbTypesNameMask | XkbCompatNameMask |
+                      XkbSymbolsNameMask | XkbGeometryNameMask;
+  if(XkbGetNames(display, mask, desc) != Success || desc->names == NULL)
+    THROW_MSG(_xkb._verbose, "Failed to get keymap component names.");
+
+  Atom atoms[5] = {desc->names->keycodes, desc->names->types, desc->names->compat,
+                   desc->names->symbols, desc->names->geometry};
+  string* out[5] = {&kc.keycodes, &kc.types, &kc.compat, &kc.symbols, &kc.geometry};
+  for(int i=0; i<5; i++) {
+    out[i]->clear();
+    if(atoms[i] == None)
+      continue;
+    char* name = XGetAtomName(display, atoms[i]);
+    if(name != NULL) {
+      *out[i] = name;
+      XFree(name);
+    }
+  }
+  CHECK_MSG(_xkb._verbose, !kc.symbols.empty(), "The keymap has no symbols component");
+}
+
+int KeymapStore::load(const string& name)
+{
+  size_t verbose = _xkb._verbose;
+  Display* display = _xkb._display;
+  CHECK(verbose, display != 0);
+
+  // "de(neo)" is the layout "de" with the variant "neo"
+  string layout = name;
+  string variant;
+  size_t paren = name.find('(');
+  if(paren != string::npos && name[name.size() - 1] == ')') {
+    layout = name.substr(0, paren);
+    variant = name.substr(paren + 1, name.size() - paren - 2);
+  }
+  CHECK_MSG(verbose, valid_name(layout) && (variant.empty() || valid_name(variant)),
+    "Group '" << name << "' is not supported by current layout. Try xkb-switch -l.");
+
+  Window root = DefaultRootWindow(display);
+  Atom rulesAtom = XInternAtom(display, rules_atom_name, False);
+  string fields[5];
+  {
+    Atom type;
+    int format;
+    unsigned long items;
+    unsigned long after;
+    unsigned char* data = NULL;
+    if(XGetWindowProperty(display, root, rulesAtom, 0, 1024, False, XA_STRING,
+          &type, &format, &items, &after, &data) == Success && data != NULL) {
+      split_rules_names(reinterpret_cast<const char*>(data), items, fields);
+    }
+    if(data != NULL)
+      XFree(data);
+  }
+  CHECK_MSG(verbose, !fields[0].empty() && !fields[2].empty(),
+    "The keymap wasn't built from rules, can't add group '" << name << "'");
+
+  vector<string> layouts = split(fields[2], ',');
+  vector<string> variants = split(fields[3], ',');
+  layouts.resize(min<size_t>(layouts.size(), XkbNumKbdGroups));
+  variants.resize(layouts.size());
+  int count = layouts.size();
+
+  // Replace the least recently used group, keeping the first one, which is
+  // usually the primary layout, and the current one. The slot indexes the
+  // layout fields, the current group and the history the layout table.
+  int slot = -1;
+  if(count < XkbNumKbdGroups) {
+    slot = count;
+  }
+  else {
+    vector<int> index = table_indices(layouts);
+    int current = _xkb.get_group();
+    vector<int> history;
+    GroupHistory(_xkb).read(history, _xkb.layout_table().size());
+    for(int g=count-1; g>0 && slot<0; g--) {
+      if(index[g] < 0 || (index[g] != current &&
+         std::find(history.begin(), history.end(), index[g]) == history.end()))
+        slot = g;
+    }
+    for(int i=history.size()-1; i>=0 && slot<0; i--) {
+      vector<int>::iterator g = std::find(index.begin(), index.end(), history[i]);
+      if(g != index.begin() && g != index.end() && history[i] != current)
+        slot = g - index.begin();
+    }
+  }
+  CHECK_MSG(verbose, slot > 0, "No group can be replaced by '" << name << "'");
+  MSG(verbose, "Loading " << name << " as group " << slot);
+
+  vector<string> newLayouts = layouts;
+  vector<string> newVariants = variants;
+  newLayouts.resize(max(count, slot + 1));
+  newVariants.resize(newLayouts.size());
+  newLayouts[slot] = layout;
+  newVariants[slot] = variant;
+  string newFields[5] = {fields[0], fields[1], join(newLayouts, ','), join(newVariants, ','),
+                         fields[4]};
+  if(newFields[3].find_first_not_of(',') == string::npos)
+    newFields[3].clear();
+
+  keymap_components kc;
+  read_components(kc);
+  vector<string> parts = split(kc.symbols, '+');
+  int part;
+  if(slot < count) {
+    part = find_group_symbols(parts, layouts[slot], variants[slot], slot);
+    if(part >= 0)
+      parts[part] = group_symbols(layout, variant, slot);
+  }
+  else {
+    part = find_group_symbols(parts, layouts[count - 1], variants[count - 1], count - 1);
+    if(part >= 0)
+      parts.insert(parts.begin() + part + 1, group_symbols(layout, variant, slot));
+  }
+  CHECK_MSG(verbose, part >= 0,
+    "Can't find the groups in the keymap symbols '" << kc.symbols << "'");
+  kc.symbols = join(parts, '+');
+  MSG(verbose, "New symbols " << kc.symbols);
+
+  XkbComponentNamesRec names;
+  memset(&names, 0, sizeof(names));
+  names.keycodes = const_cast<char*>(kc.keycodes.c_str());
+  names.types = const_cast<char*>(kc.types.c_str());
+  names.compat = const_cast<char*>(kc.compat.c_str());
+  names.symbols = const_cast<char*>(kc.symbols.c_str());
+  names.geometry = const_cast<char*>(kc.geometry.c_str());
+  unsigned int want = XkbGBN_AllComponentsMask & ~XkbGBN_GeometryMask;
+
+  // The server compiles a keymap without the group if its symbols are
+  // unknown. Try new components first, so that they don't replace the keymap.
+  {
+    XkbDescPtr desc = XkbGetKeyboardByName(display, _xkb._deviceId, &names,
+        XkbGBN_AllComponentsMask, want, False);
+    int groups = keymap_groups(desc);
+    if(desc != NULL)
+      XkbFreeKeyboard(desc, XkbAllComponentsMask, True);
+    CHECK_MSG(verbose, groups > slot, "Unknown layout '" << name << "'");
+  }
+
+  XkbDescPtr desc = XkbGetKeyboardByName(display, _xkb._deviceId, &names,
+      XkbGBN_AllComponentsMask, want, True);
+  int groups = keymap_groups(desc);
+  if(desc != NULL)
+    XkbFreeKeyboard(desc, XkbAllComponentsMask, True);
+  CHECK_MSG(verbose, groups > slot, "The X server failed to load group '" << name << "'");
+
+  // Describe the new keymap like setxkbmap does
+  string prop;
+  for(int i=0; i<5; i++) {
+    prop += newFields[i];
+    prop += '\0';
+  }
+  XChangeProperty(display, root, rulesAtom, XA_STRING, 8, PropModeReplace,
+      reinterpret_cast<const unsigned char*>(prop.data()), prop.size());
+
+  _xkb.invalidate_names();
+  return table_indices(newLayouts)[slot];
+}
+
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Switching to layouts outside of the loaded groups
+ *
+ * XKB keymaps hold at most four groups. A layout that isn't loaded replaces
+ * the least recently used group: its symbols are spliced into the symbols
+ * component of the current keymap, e.g. "pc+us+ru:2+inet(evdev)" becomes
+ * "pc+us+ru:2+de(neo):3+inet(evdev)", and the X server loads the result.
+ * The server keeps the compiled keymaps of previous loads, so only the first
+ * switch to a combination runs xkbcomp.
+ */
+
+#ifndef KEYMAPSTORE_HPP
+#define KEYMAPSTORE_HPP
+
+#include <string>
+
+#include "XKeyboard.hpp"
+
+namespace kb {
+
+// Component names of a keymap, as passed to XkbGetKeyboardByName()
+struct keymap_components {
+  std::string keycodes;
+  std::string types;
+  std::string compat;
+  std::string symbols;
+  std::string geometry;
+};
+
+class KeymapStore
+{
+public:
+  XKeyboard& _xkb;
+
+  KeymapStore(XKeyboard& xkb);
+
+  // Loads a keymap having the layout, e.g. "de" or "de(neo)", in place of the
+  // least recently used group other than the first and the current one.
+  // The rules names property is only rewritten once the X server has loaded
+  // the group. Returns the index of its group in the layout table (or throw
+  // std::runtime_error).
+  int load(const std::string& name);
+
+private:
+  void read_components(keymap_components& kc);
+};
+
+}
+
+#endif
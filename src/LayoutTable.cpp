@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Implementation of the layout table */
+
+#include <cstring>
+#include <stdexcept>
+
+#include "LayoutTable.hpp"
+
+using namespace std;
+
+namespace kb {
+
+namespace {
+
+// FNV-1a
+uint32_t hash_name(const char* s, size_t n)
+{
+  uint32_t h = 2166136261u;
+  for(size_t i = 0; i < n; i++) {
+    h ^= static_cast<unsigned char>(s[i]);
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Splits comma-separated fields like std::getline does: no field is produced
+// at the end of the string
+bool next_field(const char*& p, const char* end, const char*& field, size_t& length)
+{
+  if(p >= end) {
+    field = p;
+    length = 0;
+    return false;
+  }
+  field = p;
+  while(p < end && *p != ',')
+    p++;
+  length = p - field;
+  if(p < end)
+    p++;
+  return true;
+}
+
+}
+
+LayoutTable::LayoutTable()
+  : _count(0)
+{
+  std::memset(_buffer, 0, sizeof(_buffer));
+}
+
+LayoutTable::LayoutTable(const layout_variant_strings& lv)
+  : _count(0)
+{
+  std::memset(_buffer, 0, sizeof(_buffer));
+
+  const char* lp = lv.first.data();
+  const char* lend = lp + lv.first.size();
+  const char* vp = lv.second.data();
+  const char* vend = vp + lv.second.size();
+  size_t used = 0;
+
+  while(_count < CAPACITY) {
+    const char* l;
+    const char* v;
+    size_t ln, vn;
+    bool hasLayout = next_field(lp, lend, l, ln);
+    bool hasVariant = next_field(vp, vend, v, vn);
+    if(!hasLayout && !hasVariant)
+      break;
+    if(ln == 0)
+      continue;
+
+    size_t n = ln + (vn > 0 ? vn + 2 : 0);
+    if(n > 255 || used + n + 1 > sizeof(_buffer))
+      throw std::runtime_error("Layout names are too long.");
+
+    char* dst = _buffer + used;
+    std::memcpy(dst, l, ln);
+    if(vn > 0) {
+      dst[ln] = '(';
+      std::memcpy(dst + ln + 1, v, vn);
+      dst[ln + vn + 1] = ')';
+    }
+    dst[n] = '\0';
+
+    _offset[_count] = used;
+    _length[_count] = n;
+    _layoutLength[_count] = ln;
+    _hash[_count] = hash_name(dst, n);
+    _layoutHash[_count] = hash_name(dst, ln);
+    _count++;
+    used += n + 1;
+  }
+}
+
+const char* LayoutTable::name(int group) const
+{
+  if(group < 0 || group >= _count)
+    return NULL;
+  return _buffer + _offset[group];
+}
+
+int LayoutTable::find(const string& name) const
+{
+  uint32_t h = hash_name(name.data(), name.size());
+  for(int i = 0; i < _count; i++) {
+    if(_hash[i] == h && _length[i] == name.size() &&
+       std::memcmp(_buffer + _offset[i], name.data(), name.size()) == 0)
+      return i;
+  }
+  return -1;
+}
+
+int LayoutTable::find_layout(const string& layout) const
+{
+  uint32_t h = hash_name(layout.data(), layout.size());
+  for(int i = 0; i < _count; i++) {
+    if(_layoutHash[i] == h && _layoutLength[i] == layout.size() &&
+       std::memcmp(_buffer + _offset[i], layout.data(), layout.size()) == 0)
+      return i;
+  }
+  return -1;
+}
+
+int LayoutTable::lookup(const string& name) const
+{
+  int i = find(name);
+  return i >= 0 ? i : find_layout(name);
+}
+
+string_vector LayoutTable::to_vector() const
+{
+  string_vector out;
+  for(int i = 0; i < _count; i++)
+    out.push_back(string(_buffer + _offset[i], _length[i]));
+  return out;
+}
+
+bool LayoutTable::operator==(const LayoutTable& other) const
+{
+  if(_count != other._count)
+    return false;
+  for(int i = 0; i < _count; i++) {
+    if(_hash[i] != other._hash[i] || _length[i] != other._length[i] ||
+       std::memcmp(name(i), other.name(i), _length[i]) != 0)
+      return false;
+  }
+  return true;
+}
+
+}
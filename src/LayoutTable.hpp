@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Immutable table of layout group names */
+
+#ifndef LAYOUTTABLE_HPP
+#define LAYOUTTABLE_HPP
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <X11/XKBlib.h>
+
+namespace kb {
+
+typedef std::vector<std::string> string_vector;
+typedef std::pair<std::string,std::string> layout_variant_strings;
+
+// Group names like "ru(phonetic)" stored in one buffer. Lookups compare
+// precomputed hashes of the at most CAPACITY entries, so they take constant
+// time.
+class LayoutTable
+{
+public:
+  enum {
+    CAPACITY = XkbNumKbdGroups,
+    BUFFER_SIZE = 256,
+  };
+
+  int _count;
+  uint32_t _hash[CAPACITY];         // Hash of the full name
+  uint32_t _layoutHash[CAPACITY];   // Hash of the name without the variant
+  uint16_t _offset[CAPACITY];
+  uint8_t _length[CAPACITY];
+  uint8_t _layoutLength[CAPACITY];
+  char _buffer[BUFFER_SIZE];        // NUL-terminated names
+
+  LayoutTable();
+
+  // Builds the table from the layout and variant strings of the rules
+  // property, e.g. "us,ru" and ",phonetic", in one pass. Empty layouts are
+  // skipped, groups beyond CAPACITY are dropped (or throw std::runtime_error
+  // if the names don't fit).
+  explicit LayoutTable(const layout_variant_strings& lv);
+
+  int size() const { return _count; }
+  bool empty() const { return _count == 0; }
+
+  // Returns the name of the group or NULL if out of range
+  const char* name(int group) const;
+
+  // Returns the group with exactly this name or -1
+  int find(const std::string& name) const;
+
+  // Returns the first group of the layout ignoring variants, so that "ru"
+  // matches "ru(phonetic)", or -1
+  int find_layout(const std::string& layout) const;
+
+  // Exact match first, then the bare layout
+  int lookup(const std::string& name) const;
+
+  string_vector to_vector() const;
+
+  bool operator==(const LayoutTable& other) const;
+  bool operator!=(const LayoutTable& other) const { return !(*this == other); }
+};
+
+}
+
+#endif
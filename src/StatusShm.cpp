@@ -0,0 +1,332 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Implementation of the status segment */
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "StatusShm.hpp"
+#include "Utils.hpp"
+
+using namespace std;
+
+namespace kb {
+
+static_assert(sizeof(shm_status) == 1024, "shm_status must be 1024 bytes");
+
+namespace {
+
+// Readers give up on a publisher stuck in the middle of an update
+const int max_read_spins = 1000;
+
+// Sleeping readers check the publisher at least this often
+const int max_sleep_ms = 1000;
+
+void copy_name(char* dst, size_t size, const string& src)
+{
+  memset(dst, 0, size);
+  strncpy(dst, src.c_str(), size - 1);
+}
+
+// Sets a write lock on the whole file, held until the descriptor is closed
+bool lock_file(int fd)
+{
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  return fcntl(fd, F_SETLK, &fl) == 0;
+}
+
+// Checks whether a publisher holds the lock
+bool file_locked(int fd)
+{
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  return fcntl(fd, F_GETLK, &fl) == 0 && fl.l_type != F_UNLCK;
+}
+
+void sleep_on(const uint32_t* word, uint32_t value, int timeout_ms)
+{
+#ifdef __linux__
+  timespec ts;
+  ts.tv_sec = timeout_ms / 1000;
+  ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+  syscall(SYS_futex, const_cast<uint32_t*>(word), FUTEX_WAIT, value, &ts, NULL, 0);
+#else
+  (void)word;
+  (void)value;
+  usleep(min(timeout_ms, 50) * 1000);
+#endif
+}
+
+void wake_all(uint32_t* word)
+{
+#ifdef __linux__
+  syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#else
+  (void)word;
+#endif
+}
+
+long now_ms()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+}
+
+string runtime_file_path(const string& suffix, size_t verbose)
+{
+  const char* display = getenv("DISPLAY");
+  if(display == NULL || display[0] == '\0')
+    return "";
+
+  string dir;
+  const char* runtime = getenv("XDG_RUNTIME_DIR");
+  if(runtime != NULL && runtime[0] != '\0') {
+    dir = runtime;
+  }
+  else {
+    ostringstream oss;
+    oss << "/tmp/xkb-switch-" << getuid();
+    dir = oss.str();
+    if(mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST)
+      return "";
+    struct stat st;
+    if(lstat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) ||
+       st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+      MSG(verbose, "Refusing to use unsafe runtime directory " << dir);
+      return "";
+    }
+  }
+
+  string name(display);
+  replace(name.begin(), name.end(), '/', '_');
+  return dir + "/xkb-switch-" + name + suffix;
+}
+
+string status_file_path(size_t verbose)
+{
+  return runtime_file_path(".status", verbose);
+}
+
+StatusPublisher::StatusPublisher(const string& path, size_t verbose)
+  : _fd(-1), _status(NULL), _generation(0), _verbose(verbose)
+{
+  CHECK_MSG(verbose, !path.empty(), "Can't determine the status file path. Is DISPLAY set?");
+  _fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  CHECK_MSG(verbose, _fd >= 0, "Failed to open " << path << ": " << strerror(errno));
+  if(!lock_file(_fd)) {
+    ::close(_fd);
+    THROW_MSG(verbose, "Another xkb-switch publishes the status to " << path);
+  }
+  void* p = MAP_FAILED;
+  if(ftruncate(_fd, sizeof(shm_status)) == 0)
+    p = mmap(NULL, sizeof(shm_status), PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+  if(p == MAP_FAILED) {
+    int err = errno;
+    ::close(_fd);
+    THROW_MSG(verbose, "Failed to map " << path << ": " << strerror(err));
+  }
+  _status = static_cast<shm_status*>(p);
+
+  // Keep the counters of a previous publisher, so that sleeping readers see
+  // the restart as an update
+  uint32_t seq = _status->seq | 1;
+  __atomic_store_n(&_status->seq, seq, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  _status->magic = STATUS_MAGIC;
+  _status->size = sizeof(shm_status);
+  _status->pid = getpid();
+  _status->group = -1;
+  _status->count = 0;
+  _status->reserved = 0;
+  memset(_status->name, 0, sizeof(_status->name));
+  memset(_status->fancy, 0, sizeof(_status->fancy));
+  memset(_status->layouts, 0, sizeof(_status->layouts));
+  __atomic_store_n(&_status->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+StatusPublisher::~StatusPublisher()
+{
+  if(_status != NULL)
+    munmap(_status, sizeof(shm_status));
+  if(_fd >= 0)
+    ::close(_fd);
+}
+
+void StatusPublisher::publish(XKeyboard& xkb, int group)
+{
+  bool renamed = false;
+  if(_fancyNames.empty() || _generation != xkb.generation()) {
+    _generation = xkb.generation();
+    const LayoutTable& table = xkb.layout_table();
+    _layouts.clear();
+    for(int i=0; i<table.size(); i++) {
+      if(i > 0)
+        _layouts += ' ';
+      _layouts += table.name(i);
+    }
+    _fancyNames = xkb.group_names();
+    _fancyNames.resize(table.size());
+    renamed = true;
+  }
+  if(!renamed && group == _status->group)
+    return;
+
+  const char* name = xkb.layout_table().name(group);
+  bool valid = name != NULL;
+
+  uint32_t seq = _status->seq;
+  __atomic_store_n(&_status->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  _status->group = valid ? group : -1;
+  _status->count = _fancyNames.size();
+  copy_name(_status->name, sizeof(_status->name), valid ? name : "");
+  copy_name(_status->fancy, sizeof(_status->fancy), valid ? _fancyNames[group] : "");
+  copy_name(_status->layouts, sizeof(_status->layouts), _layouts);
+  __atomic_store_n(&_status->seq, seq + 2, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&_status->generation, 1, __ATOMIC_RELEASE);
+  wake_all(&_status->generation);
+  MSG(_verbose, "Published group " << group << ", generation " << _status->generation);
+}
+
+StatusReader::StatusReader()
+  : _fd(-1), _status(NULL)
+{
+}
+
+StatusReader::~StatusReader()
+{
+  if(_status != NULL)
+    munmap(const_cast<shm_status*>(_status), sizeof(shm_status));
+  if(_fd >= 0)
+    ::close(_fd);
+}
+
+bool StatusReader::open(const string& path)
+{
+  if(_status != NULL) {
+    munmap(const_cast<shm_status*>(_status), sizeof(shm_status));
+    _status = NULL;
+  }
+  if(_fd >= 0) {
+    ::close(_fd);
+    _fd = -1;
+  }
+  _path = path;
+  if(path.empty())
+    return false;
+
+  _fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if(_fd < 0)
+    return false;
+  struct stat st;
+  void* p = MAP_FAILED;
+  if(fstat(_fd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(shm_status)))
+    p = mmap(NULL, sizeof(shm_status), PROT_READ, MAP_SHARED, _fd, 0);
+  if(p == MAP_FAILED) {
+    ::close(_fd);
+    _fd = -1;
+    return false;
+  }
+  _status = static_cast<const shm_status*>(p);
+  return true;
+}
+
+bool StatusReader::read(shm_status& status)
+{
+  if(_status == NULL)
+    return false;
+
+  int spins = 0;
+  while(true) {
+    uint32_t seq = __atomic_load_n(&_status->seq, __ATOMIC_ACQUIRE);
+    if((seq & 1) == 0) {
+      memcpy(&status, _status, sizeof(status));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if(__atomic_load_n(&_status->seq, __ATOMIC_RELAXED) == seq)
+        break;
+    }
+    if(++spins > max_read_spins)
+      return false;
+    sched_yield();
+  }
+  return status.magic == STATUS_MAGIC && status.size == sizeof(shm_status) &&
+         file_locked(_fd);
+}
+
+int StatusReader::wait(uint32_t generation, int timeout_ms)
+{
+  long deadline = now_ms() + timeout_ms;
+  while(true) {
+    shm_status status;
+    if(!read(status))
+      return -1;
+    if(status.generation != generation)
+      return 1;
+
+    int slice = max_sleep_ms;
+    if(timeout_ms >= 0) {
+      long left = deadline - now_ms();
+      if(left <= 0)
+        return 0;
+      slice = min<long>(slice, left);
+    }
+    sleep_on(&_status->generation, generation, slice);
+  }
+}
+
+void publish_groups(XKeyboard& xkb, StatusPublisher& publisher)
+{
+  xkb.enable_cache();
+  while(true) {
+    publisher.publish(xkb, xkb.get_group());
+
+    xkb.wait_event();
+    xkb.process_events();
+  }
+}
+
+}
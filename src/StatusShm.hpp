@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Status segment: the keyboard state published in a memory-mapped file */
+
+#ifndef STATUSSHM_HPP
+#define STATUSSHM_HPP
+
+#include <stdint.h>
+#include <string>
+
+#include "XKeyboard.hpp"
+
+namespace kb {
+
+#define STATUS_MAGIC 0x54534b58u  /* "XKST" */
+
+// Layout of the status file, fields are in host byte order. The publisher
+// makes seq odd while it writes, so readers retry until they copy the data
+// between two equal even values (a seqlock). generation is incremented after
+// every update and doubles as a futex word to sleep on.
+struct shm_status {
+  uint32_t magic;       // STATUS_MAGIC
+  uint32_t size;        // sizeof(shm_status), 1024
+  uint32_t seq;         // Seqlock sequence
+  uint32_t generation;  // Number of updates
+  int32_t pid;          // Publisher process
+  int32_t group;        // Current group
+  int32_t count;        // Number of groups
+  int32_t reserved;
+  char name[40];        // Short name of the current group, truncated if needed
+  char fancy[64];       // Fancy name of the current group, truncated if needed
+  char layouts[888];    // Short names of all groups separated by spaces
+};
+
+// Returns the per-user, per-display path of a runtime file, e.g. of the
+// daemon socket, or an empty string if it can't be determined
+std::string runtime_file_path(const std::string& suffix, size_t verbose);
+
+// Returns the path of the status file of $DISPLAY
+std::string status_file_path(size_t verbose);
+
+// Writer of the status file. Only one publisher per display may run.
+class StatusPublisher
+{
+public:
+  int _fd;
+  shm_status* _status;
+  unsigned long _generation;  // XKeyboard generation of the names below
+  std::string _layouts;
+  string_vector _fancyNames;
+  size_t _verbose;
+
+  // Creates or reuses the file (or throw std::runtime_error)
+  StatusPublisher(const std::string& path, size_t verbose);
+  ~StatusPublisher();
+
+  // Publishes the group if it or the layouts changed and wakes the readers
+  void publish(XKeyboard& xkb, int group);
+};
+
+// Reader of the status file, needs no X connection
+class StatusReader
+{
+public:
+  int _fd;
+  const shm_status* _status;
+  std::string _path;
+
+  StatusReader();
+  ~StatusReader();
+
+  // Maps the file, returns false if there is none
+  bool open(const std::string& path);
+
+  // Copies a consistent snapshot. Returns false if no publisher is running.
+  bool read(shm_status& status);
+
+  // Sleeps until the generation differs from the given one. Returns 1 on a
+  // change, 0 on timeout (negative timeout means none) and -1 if no
+  // publisher is running.
+  int wait(uint32_t generation, int timeout_ms);
+};
+
+// Publishes every change of the effective group until interrupted
+void publish_groups(XKeyboard& xkb, StatusPublisher& publisher);
+
+}
+
+#endif
@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Implementation of the -W output formats */
+
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+
+#include "Stream.hpp"
+#include "Utils.hpp"
+
+using namespace std;
+
+namespace kb {
+
+static_assert(sizeof(stream_record) == 128, "stream_record must be 128 bytes");
+
+string json_escape(const string& str)
+{
+  string out;
+  for(size_t i=0; i<str.size(); i++) {
+    unsigned char c = str[i];
+    if(c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    }
+    else if(c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out += buf;
+    }
+    else {
+      out += c;
+    }
+  }
+  return out;
+}
+
+namespace {
+
+void copy_name(char* dst, size_t size, const string& src)
+{
+  std::memset(dst, 0, size);
+  std::strncpy(dst, src.c_str(), size - 1);
+}
+
+void build_entries(XKeyboard& xkb, stream_format format, int fancy,
+                   vector<group_entry>& entries)
+{
+  string_vector names;
+  string_vector fancyNames;
+  if(format != FORMAT_TEXT || !fancy)
+    names = xkb.layout();
+  if(format != FORMAT_TEXT || fancy)
+    fancyNames = xkb.group_names();
+
+  size_t count = max(names.size(), fancyNames.size());
+  names.resize(count);
+  fancyNames.resize(count);
+
+  entries.resize(count);
+  for(size_t i=0; i<count; i++) {
+    group_entry& e = entries[i];
+    e.text = (fancy ? fancyNames[i] : names[i]) + "\n";
+
+    ostringstream oss;
+    oss << ",\"group\":" << i
+        << ",\"name\":\"" << json_escape(names[i]) << "\""
+        << ",\"fancy\":\"" << json_escape(fancyNames[i]) << "\"}\n";
+    e.json = oss.str();
+
+    std::memset(&e.record, 0, sizeof(e.record));
+    e.record.magic = STREAM_RECORD_MAGIC;
+    e.record.size = sizeof(stream_record);
+    e.record.group = i;
+    copy_name(e.record.name, sizeof(e.record.name), names[i]);
+    copy_name(e.record.fancy, sizeof(e.record.fancy), fancyNames[i]);
+  }
+}
+
+void write_entry(Writer& out, const GroupStream& s, const group_entry& e,
+                 Time time, int prev)
+{
+  switch(s._format) {
+    case FORMAT_TEXT:
+      out.write(s._tagText);
+      out.write(e.text);
+      break;
+    case FORMAT_JSONL: {
+      char head[64];
+      int n = snprintf(head, sizeof(head), "{\"time\":%lu", (unsigned long)time);
+      out.write(head, n);
+      out.write(s._tagJson);
+      n = snprintf(head, sizeof(head), ",\"prev_group\":%d", prev);
+      out.write(head, n);
+      out.write(e.json);
+      break;
+    }
+    case FORMAT_BINARY: {
+      stream_record r = e.record;
+      r.time = time;
+      r.prev_group = prev;
+      out.write(reinterpret_cast<const char*>(&r), sizeof(r));
+      break;
+    }
+  }
+  out.end_record();
+}
+
+}
+
+stream_format parse_stream_format(const string& str, size_t verbose)
+{
+  if(str == "text")
+    return FORMAT_TEXT;
+  if(str == "jsonl")
+    return FORMAT_JSONL;
+  if(str == "binary")
+    return FORMAT_BINARY;
+  THROW_MSG(verbose, "Unknown format '" << str << "'. Expected text, jsonl or binary.");
+}
+
+GroupStream::GroupStream(stream_format format, int fancy, const string& tagText,
+                         const string& tagJson, size_t verbose)
+  : _format(format), _fancy(fancy), _tagText(tagText), _tagJson(tagJson),
+    _generation(0), _group(-1)
+{
+  CHECK_MSG(verbose, format != FORMAT_BINARY || (tagText.empty() && tagJson.empty()),
+      "The binary format doesn't support multiple keyboards");
+}
+
+void GroupStream::reset()
+{
+  _entries.clear();
+  _group = -1;
+  _last.clear();
+}
+
+void GroupStream::update(XKeyboard& xkb, int g, Writer& out)
+{
+  bool renamed = false;
+  if(_entries.empty() || _generation != xkb.generation()) {
+    _generation = xkb.generation();
+    build_entries(xkb, _format, _fancy, _entries);
+    renamed = true;
+  }
+
+  if(g < 0 || g >= static_cast<int>(_entries.size()))
+    return;
+
+  const group_entry& e = _entries[g];
+  if(_group < 0) {
+    // The text format doesn't report the initial state
+    if(_format != FORMAT_TEXT)
+      write_entry(out, *this, e, xkb.event_time(), -1);
+  }
+  else if(g != _group || (renamed && e.text != _last)) {
+    write_entry(out, *this, e, xkb.event_time(), _group);
+  }
+  _group = g;
+  _last = e.text;
+}
+
+void stream_groups(XKeyboard& xkb, stream_format format, int fancy, Writer& out,
+                   stream_hook hook, StatusPublisher* publisher)
+{
+  GroupStream stream(format, fancy, "", "", xkb._verbose);
+
+  xkb.enable_cache();
+  while(true) {
+    int group = xkb.get_group();
+    stream.update(xkb, group, out);
+    if(publisher)
+      publisher->publish(xkb, group);
+
+    xkb.wait_event();
+    xkb.process_events();
+    if(hook)
+      hook(xkb);
+  }
+}
+
+void stream_devices(XKeyboard& xkb, const device_vector& devices,
+                    stream_format format, int fancy, Writer& out,
+                    stream_hook hook)
+{
+  vector<GroupStream> streams;
+  vector<int> ids;
+  for(size_t i=0; i<devices.size(); i++) {
+    ostringstream json;
+    json << ",\"device\":" << devices[i].id
+         << ",\"device_name\":\"" << json_escape(devices[i].name) << "\"";
+    streams.push_back(GroupStream(format, fancy, devices[i].name + "\t",
+                                  json.str(), xkb._verbose));
+    ids.push_back(devices[i].id);
+  }
+
+  xkb.enable_cache();
+  xkb.select_device_events(ids);
+
+  while(true) {
+    for(size_t i=0; i<devices.size(); i++) {
+      streams[i].update(xkb, xkb.get_device_group(devices[i].id), out);
+    }
+
+    xkb.wait_event();
+    xkb.process_events();
+    if(hook)
+      hook(xkb);
+  }
+}
+
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Streaming of layout group changes (the -W mode) */
+
+#ifndef STREAM_HPP
+#define STREAM_HPP
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "XKeyboard.hpp"
+#include "XDevices.hpp"
+#include "Writer.hpp"
+#include "StatusShm.hpp"
+
+namespace kb {
+
+// Output formats of the -W mode
+enum stream_format {
+  FORMAT_TEXT,    // Group name per line
+  FORMAT_JSONL,   // JSON object per line
+  FORMAT_BINARY,  // Fixed-size stream_record structures
+};
+
+#define STREAM_RECORD_MAGIC 0x53424b58u  /* "XKBS" */
+
+// Record of the binary format, fields are in host byte order
+struct stream_record {
+  uint32_t magic;      // STREAM_RECORD_MAGIC
+  uint32_t size;       // sizeof(stream_record), 128
+  uint64_t time;       // X server time of the event in milliseconds
+  int32_t group;       // New group
+  int32_t prev_group;  // Previous group, -1 for the initial record
+  char name[40];       // Short name, zero-padded, truncated if needed
+  char fancy[64];      // Fancy name, zero-padded, truncated if needed
+};
+
+// Precomputed output of a single group
+struct group_entry {
+  std::string text;     // Text line
+  std::string json;     // Tail of the JSON object, starting from "group"
+  stream_record record; // Binary record without time and prev_group
+};
+
+// Output of the group changes of one keyboard. Names of all groups are
+// resolved in advance and only re-resolved after keymap changes.
+class GroupStream
+{
+public:
+  stream_format _format;
+  int _fancy;
+  std::string _tagText;   // Prefix of text lines
+  std::string _tagJson;   // Extra JSON fields, starting with a comma
+  std::vector<group_entry> _entries;
+  unsigned long _generation;
+  int _group;             // Last reported group, -1 before the first record
+  std::string _last;      // Text of the last record
+
+  // Tags are not supported by the binary format (or throw std::runtime_error)
+  GroupStream(stream_format format, int fancy, const std::string& tagText,
+              const std::string& tagJson, size_t verbose);
+
+  // Writes a record if the group or its name changed since the last call.
+  // The structured formats also report the initial state.
+  void update(XKeyboard& xkb, int group, Writer& out);
+
+  // Forgets the keyboard, e.g. after reconnecting to the server
+  void reset();
+};
+
+// Escapes a string for a JSON string literal
+std::string json_escape(const std::string& str);
+
+// Parses the --format argument (or throw std::runtime_error)
+stream_format parse_stream_format(const std::string& str, size_t verbose);
+
+// Called every time the stream wakes up, including interruptions by signals
+typedef void (*stream_hook)(const XKeyboard& xkb);
+
+// Writes a record every time the effective group changes. Names of all groups
+// are resolved in advance and only re-resolved after keymap changes. The
+// structured formats also report the initial state. Every change is also
+// published to the status file if a publisher is given.
+void stream_groups(XKeyboard& xkb, stream_format format, int fancy, Writer& out,
+                   stream_hook hook = NULL, StatusPublisher* publisher = NULL);
+
+// Like stream_groups() for every listed keyboard at once. Text lines are
+// prefixed with the device name and a tab, JSON objects get "device" and
+// "device_name" fields. The binary format is not supported.
+void stream_devices(XKeyboard& xkb, const device_vector& devices,
+                    stream_format format, int fancy, Writer& out,
+                    stream_hook hook = NULL);
+
+}
+
+#endif
@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Implementation of the wrong layout text conversion */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <map>
+
+#include <unistd.h>
+
+#include <X11/XKBlib.h>
+
+#include "TextConverter.hpp"
+#include "Keysyms.hpp"
+#include "Utils.hpp"
+
+using namespace std;
+
+namespace kb {
+
+namespace {
+
+// Input is read in blocks of this size
+const size_t block_size = 1 << 16;
+
+void write_all(int fd, const char* data, size_t len, size_t verbose)
+{
+  while(len > 0) {
+    ssize_t n = write(fd, data, len);
+    if(n < 0 && errno == EINTR)
+      continue;
+    CHECK_MSG(verbose, n > 0, "Failed to write the output: " << strerror(errno));
+    data += n;
+    len -= n;
+  }
+}
+
+convert_entry make_entry(uint32_t cp)
+{
+  convert_entry e;
+  memset(&e, 0, sizeof(e));
+  if(cp < 0x80) {
+    e.utf8[0] = cp;
+    e.len = 1;
+  }
+  else if(cp < 0x800) {
+    e.utf8[0] = 0xc0 | (cp >> 6);
+    e.utf8[1] = 0x80 | (cp & 0x3f);
+    e.len = 2;
+  }
+  else if(cp < 0x10000) {
+    e.utf8[0] = 0xe0 | (cp >> 12);
+    e.utf8[1] = 0x80 | ((cp >> 6) & 0x3f);
+    e.utf8[2] = 0x80 | (cp & 0x3f);
+    e.len = 3;
+  }
+  else {
+    e.utf8[0] = 0xf0 | (cp >> 18);
+    e.utf8[1] = 0x80 | ((cp >> 12) & 0x3f);
+    e.utf8[2] = 0x80 | ((cp >> 6) & 0x3f);
+    e.utf8[3] = 0x80 | (cp & 0x3f);
+    e.len = 4;
+  }
+  return e;
+}
+
+bool entry_less(const pair<uint32_t, convert_entry>& e, uint32_t cp)
+{
+  return e.first < cp;
+}
+
+}
+
+TextConverter::TextConverter()
+  : _from(-1), _to(-1), _generation(0), _twoByte(0x800)
+{
+  build(vector<pair<uint32_t, uint32_t> >());
+}
+
+void TextConverter::build(const vector<pair<uint32_t, uint32_t> >& pairs)
+{
+  for(uint32_t c=0; c<0x80; c++) {
+    _ascii[c] = make_entry(c);
+  }
+  convert_entry copy;
+  memset(&copy, 0, sizeof(copy));
+  fill(_twoByte.begin(), _twoByte.end(), copy);
+  _other.clear();
+
+  for(size_t i=0; i<pairs.size(); i++) {
+    uint32_t cp = pairs[i].first;
+    convert_entry e = make_entry(pairs[i].second);
+    if(cp < 0x80)
+      _ascii[cp] = e;
+    else if(cp < 0x800)
+      _twoByte[cp] = e;
+    else
+      _other.push_back(make_pair(cp, e));
+  }
+  sort(_other.begin(), _other.end(),
+       [](const pair<uint32_t, convert_entry>& a, const pair<uint32_t, convert_entry>& b) {
+         return a.first < b.first;
+       });
+}
+
+void TextConverter::prepare(XKeyboard& xkb, int from, int to)
+{
+  size_t verbose = xkb._verbose;
+  CHECK_MSG(verbose, from >= 0 && from < XkbNumKbdGroups && to >= 0 && to < XkbNumKbdGroups,
+      "Group out of range");
+  XkbDescPtr desc = const_cast<XkbDescPtr>(xkb.keymap());
+  if(_from == from && _to == to && _generation == xkb.generation())
+    return;
+
+  // The first key typing a character wins. Only the plain and the shifted
+  // levels take part, other levels hold symbols rather than letters.
+  map<uint32_t, uint32_t> chars;
+  for(int k=desc->min_key_code; k<=desc->max_key_code; k++) {
+    int groups = XkbKeyNumGroups(desc, k);
+    if(groups == 0)
+      continue;
+    // Keys with fewer groups repeat the first one
+    int a = from < groups ? from : 0;
+    int b = to < groups ? to : 0;
+    int levels = min<int>(min<int>(XkbKeyGroupWidth(desc, k, a), XkbKeyGroupWidth(desc, k, b)), 2);
+    for(int l=0; l<levels; l++) {
+      uint32_t ca = keysym_to_ucs(XkbKeySymEntry(desc, k, l, a));
+      uint32_t cb = keysym_to_ucs(XkbKeySymEntry(desc, k, l, b));
+      if(ca != 0 && cb != 0 && ca != cb)
+        chars.insert(make_pair(ca, cb));
+    }
+  }
+  MSG(verbose, chars.size() << " characters differ between groups " << from << " and " << to);
+
+  build(vector<pair<uint32_t, uint32_t> >(chars.begin(), chars.end()));
+  _from = from;
+  _to = to;
+  _generation = xkb.generation();
+}
+
+size_t TextConverter::convert(const char* in, size_t len, char* out, size_t* consumed) const
+{
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(in);
+  const unsigned char* end = p + len;
+  char* o = out;
+
+  while(p < end) {
+    // ASCII runs go eight bytes at a time. Every entry is stored with a
+    // fixed four-byte copy, the output advances by its real length.
+    while(end - p >= 8) {
+      uint64_t w;
+      memcpy(&w, p, sizeof(w));
+      if(w & 0x8080808080808080ULL)
+        break;
+      for(int i=0; i<8; i++) {
+        const convert_entry& e = _ascii[p[i]];
+        memcpy(o, e.utf8, 4);
+        o += e.len;
+      }
+      p += 8;
+    }
+    if(p == end)
+      break;
+
+    unsigned char c = *p;
+    if(c < 0x80) {
+      const convert_entry& e = _ascii[c];
+      memcpy(o, e.utf8, 4);
+      o += e.len;
+      p++;
+      continue;
+    }
+
+    size_t n = c >= 0xf8 ? 0 : c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 0;
+    size_t avail = min<size_t>(n, end - p);
+    size_t valid = 1;
+    while(valid < avail && (p[valid] & 0xc0) == 0x80)
+      valid++;
+    if(n == 0 || (valid < n && valid < avail)) {
+      // Stray continuation byte or broken sequence
+      *o++ = *p++;
+      continue;
+    }
+    if(valid < n) {
+      // Incomplete sequence at the end of the input
+      if(consumed)
+        break;
+      memcpy(o, p, valid);
+      o += valid;
+      p += valid;
+      break;
+    }
+
+    const convert_entry* e = NULL;
+    if(n == 2) {
+      e = &_twoByte[((c & 0x1f) << 6) | (p[1] & 0x3f)];
+    }
+    else if(!_other.empty()) {
+      uint32_t cp = n == 3 ? ((c & 0x0f) << 12) | ((p[1] & 0x3f) << 6) | (p[2] & 0x3f)
+                           : ((c & 0x07) << 18) | ((p[1] & 0x3f) << 12) |
+                             ((p[2] & 0x3f) << 6) | (p[3] & 0x3f);
+      vector<pair<uint32_t, convert_entry> >::const_iterator i =
+        lower_bound(_other.begin(), _other.end(), cp, entry_less);
+      if(i != _other.end() && i->first == cp)
+        e = &i->second;
+    }
+    if(e != NULL && e->len != 0) {
+      memcpy(o, e->utf8, 4);
+      o += e->len;
+    }
+    else {
+      memcpy(o, p, n);
+      o += n;
+    }
+    p += n;
+  }
+
+  if(consumed)
+    *consumed = reinterpret_cast<const char*>(p) - in;
+  return o - out;
+}
+
+void convert_stream(const TextConverter& converter, int in, int out, size_t verbose)
+{
+  // A sequence split between two reads is carried over to the next block
+  vector<char> input(block_size + 4);
+  vector<char> output(4 * input.size());
+  size_t carried = 0;
+  while(true) {
+    ssize_t n = read(in, &input[carried], block_size);
+    if(n < 0 && errno == EINTR)
+      continue;
+    CHECK_MSG(verbose, n >= 0, "Failed to read the input: " << strerror(errno));
+    size_t len = carried + n;
+    size_t taken = 0;
+    size_t produced = converter.convert(&input[0], len, &output[0], n > 0 ? &taken : NULL);
+    write_all(out, &output[0], produced, verbose);
+    if(n == 0)
+      break;
+    carried = len - taken;
+    memmove(&input[0], &input[taken], carried);
+  }
+}
+
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Retyping of text typed in the wrong layout group */
+
+#ifndef TEXTCONVERTER_HPP
+#define TEXTCONVERTER_HPP
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "XKeyboard.hpp"
+
+namespace kb {
+
+// UTF-8 sequence replacing one input character
+struct convert_entry {
+  uint8_t len;     // Length of the output, 0 copies the input character
+  char utf8[7];    // Output, zero-padded so that four bytes can be copied
+};
+
+// Maps every character of one group to the character of the same key and
+// shift level in another group. The tables are dense for the one- and
+// two-byte UTF-8 sequences, which cover the Latin, Cyrillic, Greek, Hebrew
+// and Arabic layouts; longer sequences are looked up in a sorted list.
+class TextConverter
+{
+public:
+  int _from;
+  int _to;
+  unsigned long _generation;  // XKeyboard generation the tables were built at
+  convert_entry _ascii[128];
+  std::vector<convert_entry> _twoByte;  // Indexed by the 11 bits of the sequence
+  std::vector<std::pair<uint32_t, convert_entry> > _other;  // Sorted
+
+  TextConverter();
+
+  // Builds the tables for the groups unless they are built for the same
+  // groups and keymap already (or throw std::runtime_error)
+  void prepare(XKeyboard& xkb, int from, int to);
+
+  // Builds the tables from pairs of characters typed by the same key
+  void build(const std::vector<std::pair<uint32_t, uint32_t> >& pairs);
+
+  // Converts UTF-8 text into out, which must hold 4 * len bytes, and returns
+  // the output length. Invalid bytes are copied. If consumed isn't NULL, an
+  // incomplete sequence at the end is left for the next call and the number
+  // of bytes taken is stored, otherwise it is copied as is.
+  size_t convert(const char* in, size_t len, char* out, size_t* consumed) const;
+};
+
+// Converts everything read from the input descriptor into the output one
+// until the end of input (or throw std::runtime_error)
+void convert_stream(const TextConverter& converter, int in, int out, size_t verbose);
+
+}
+
+#endif
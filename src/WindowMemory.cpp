@@ -0,0 +1,348 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Implementation of the per-window layout memory */
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
+
+#include "WindowMemory.hpp"
+#include "WindowRules.hpp"
+#include "Utils.hpp"
+
+using namespace std;
+
+namespace kb {
+
+namespace {
+
+volatile sig_atomic_t stop_requested = 0;
+
+void on_stop_signal(int)
+{
+  stop_requested = 1;
+}
+
+XErrorHandler default_error_handler = NULL;
+
+// Watches the directory of the rules file, so that editors replacing the
+// file by a rename are noticed too. Returns -1 if inotify is unavailable.
+int watch_rules(const string& path, size_t verbose)
+{
+  size_t slash = path.rfind('/');
+  string dir = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if(fd >= 0 && inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    close(fd);
+    fd = -1;
+  }
+  if(fd < 0)
+    MSG(verbose, "Can't watch " << dir << ": " << strerror(errno));
+  return fd;
+}
+
+// Reads the pending notifications, returns true if one is about the file
+bool rules_written(int fd, const string& path)
+{
+  size_t slash = path.rfind('/');
+  string name = slash == string::npos ? path : path.substr(slash + 1);
+  bool written = false;
+  char buf[4096] __attribute__((aligned(__alignof__(inotify_event))));
+  ssize_t n;
+  while((n = read(fd, buf, sizeof(buf))) > 0) {
+    for(char* p = buf; p < buf + n; ) {
+      const inotify_event* e = reinterpret_cast<const inotify_event*>(p);
+      if(e->len > 0 && name == e->name)
+        written = true;
+      p += sizeof(inotify_event) + e->len;
+    }
+  }
+  return written;
+}
+
+// Windows may be destroyed before we select their events
+int ignore_bad_window(Display* display, XErrorEvent* error)
+{
+  if(error->error_code == BadWindow)
+    return 0;
+  return default_error_handler(display, error);
+}
+
+Window get_active_window(Display* display, Atom active)
+{
+  Atom type;
+  int format;
+  unsigned long count;
+  unsigned long after;
+  unsigned char* data = NULL;
+  Window w = None;
+
+  if(XGetWindowProperty(display, DefaultRootWindow(display), active, 0, 1,
+        False, XA_WINDOW, &type, &format, &count, &after, &data) == Success) {
+    if(data != NULL && type == XA_WINDOW && format == 32 && count == 1)
+      w = *reinterpret_cast<Window*>(data);
+  }
+  if(data != NULL)
+    XFree(data);
+  return w;
+}
+
+// Reads WM_CLASS and the title, preferring the UTF-8 _NET_WM_NAME
+void get_window_names(Display* display, Window w, Atom netName, Atom utf8,
+                      string& instance, string& cls, string& name)
+{
+  XClassHint hint;
+  if(XGetClassHint(display, w, &hint)) {
+    instance = hint.res_name ? hint.res_name : "";
+    cls = hint.res_class ? hint.res_class : "";
+    if(hint.res_name)
+      XFree(hint.res_name);
+    if(hint.res_class)
+      XFree(hint.res_class);
+  }
+
+  Atom type;
+  int format;
+  unsigned long count;
+  unsigned long after;
+  unsigned char* data = NULL;
+  if(XGetWindowProperty(display, w, netName, 0, 1024, False, utf8, &type,
+        &format, &count, &after, &data) == Success && data != NULL &&
+     type == utf8 && format == 8) {
+    name.assign(reinterpret_cast<char*>(data), count);
+  }
+  else {
+    char* title = NULL;
+    if(XFetchName(display, w, &title) && title != NULL) {
+      name = title;
+      XFree(title);
+    }
+  }
+  if(data != NULL)
+    XFree(data);
+}
+
+}
+
+WindowMemory::WindowMemory(size_t capacity)
+  : _capacity(capacity)
+{
+}
+
+bool WindowMemory::get(Window w, int& group)
+{
+  unordered_map<Window, lru_list::iterator>::iterator i = _index.find(w);
+  if(i == _index.end())
+    return false;
+  _lru.splice(_lru.begin(), _lru, i->second);
+  group = i->second->second;
+  return true;
+}
+
+Window WindowMemory::put(Window w, int group)
+{
+  unordered_map<Window, lru_list::iterator>::iterator i = _index.find(w);
+  if(i != _index.end()) {
+    i->second->second = group;
+    _lru.splice(_lru.begin(), _lru, i->second);
+    return None;
+  }
+
+  _lru.push_front(make_pair(w, group));
+  _index[w] = _lru.begin();
+  if(_lru.size() <= _capacity)
+    return None;
+
+  Window evicted = _lru.back().first;
+  _index.erase(evicted);
+  _lru.pop_back();
+  return evicted;
+}
+
+void WindowMemory::erase(Window w)
+{
+  unordered_map<Window, lru_list::iterator>::iterator i = _index.find(w);
+  if(i == _index.end())
+    return;
+  _lru.erase(i->second);
+  _index.erase(i);
+}
+
+void run_per_window(XKeyboard& xkb, size_t capacity, const string& rulesPath)
+{
+  size_t verbose = xkb._verbose;
+  Display* display = xkb._display;
+  CHECK(verbose, display != 0);
+
+  // Root property changes are selected together with the XKB events
+  xkb.enable_cache();
+  Atom active = XInternAtom(display, "_NET_ACTIVE_WINDOW", False);
+  Atom netName = XInternAtom(display, "_NET_WM_NAME", False);
+  Atom utf8 = XInternAtom(display, "UTF8_STRING", False);
+  default_error_handler = XSetErrorHandler(ignore_bad_window);
+
+  WindowRules rules(verbose);
+  int rulesWatch = -1;
+  if(!rulesPath.empty()) {
+    rulesWatch = watch_rules(rulesPath, verbose);
+    rules.load(rulesPath);
+  }
+  bool rulesWritten = false;
+  // Rule of every known window, -1 if none matches
+  unordered_map<Window, int> verdicts;
+
+  struct sigaction sa;
+  std::memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_stop_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  WindowMemory memory(capacity);
+  Window focused = None;
+  bool focusRemembered = false;  // The group of the focused window is remembered
+  bool focusChanged = true;
+
+  while(!stop_requested) {
+    // Apply edited rules to the focused window right away
+    if(rulesWritten && rules.reload()) {
+      MSG(verbose, "Rules reloaded from " << rulesPath);
+      verdicts.clear();
+      focused = None;
+      focusChanged = true;
+    }
+    rulesWritten = false;
+
+    if(focusChanged) {
+      focusChanged = false;
+      Window w = get_active_window(display, active);
+      if(w != focused) {
+        focused = w;
+        focusRemembered = false;
+
+        // Forget the window once it is destroyed, match the rules again
+        // after its title changes
+        if(w != None && (!memory._index.count(w) || !rules.empty()) && !verdicts.count(w)) {
+          XSelectInput(display, w, StructureNotifyMask |
+                       (rules.empty() ? 0 : PropertyChangeMask));
+        }
+
+        int rule = -1;
+        if(w != None && !rules.empty()) {
+          unordered_map<Window, int>::iterator v = verdicts.find(w);
+          if(v == verdicts.end()) {
+            string instance, cls, name;
+            get_window_names(display, w, netName, utf8, instance, cls, name);
+            rule = rules.match(instance, cls, name);
+            verdicts[w] = rule;
+            MSG(verbose, "Window 0x" << std::hex << w << std::dec << " class \""
+                << instance << "\" \"" << cls << "\" name \"" << name << "\", rule " << rule);
+          }
+          else {
+            rule = v->second;
+          }
+        }
+
+        int group;
+        if(rule >= 0 && !rules._rules[rule].layout.empty()) {
+          const string& layout = rules._rules[rule].layout;
+          group = xkb.layout_table().lookup(layout);
+          if(group < 0) {
+            MSG(verbose, "Layout '" << layout << "' of rule " << rule << " is not configured");
+          }
+          else if(group != xkb.group()) {
+            xkb.lock_group(group, false);
+          }
+        }
+        else if(w != None && memory.get(w, group)) {
+          focusRemembered = true;
+          MSG(verbose, "Window 0x" << std::hex << w << std::dec << " focused, group " << group);
+          // A restore is a single lock, flushed below. Restores stay out of
+          // the group history, which tracks the choices of the user.
+          if(group != xkb.group())
+            xkb.lock_group(group, false);
+        }
+        else if(w != None) {
+          focusRemembered = true;
+          MSG(verbose, "New window 0x" << std::hex << w << std::dec);
+          Window evicted = memory.put(w, xkb.group());
+          if(evicted != None && verdicts.find(evicted) == verdicts.end())
+            XSelectInput(display, evicted, NoEventMask);
+        }
+        XFlush(display);
+      }
+    }
+
+    while(XPending(display)) {
+      XEvent event;
+      XNextEvent(display, &event);
+      event_kind kind = xkb.handle_event(event);
+      if(kind == EVENT_STATE && focusRemembered) {
+        memory.put(focused, xkb.group());
+      }
+      else if(event.type == PropertyNotify && event.xproperty.atom == active) {
+        focusChanged = true;
+      }
+      else if(event.type == PropertyNotify && !rules._nameRules.empty() &&
+              (event.xproperty.atom == netName || event.xproperty.atom == XA_WM_NAME)) {
+        verdicts.erase(event.xproperty.window);
+        if(event.xproperty.window == focused) {
+          focused = None;
+          focusChanged = true;
+        }
+      }
+      else if(event.type == DestroyNotify) {
+        memory.erase(event.xdestroywindow.window);
+        verdicts.erase(event.xdestroywindow.window);
+      }
+    }
+    if(focusChanged)
+      continue;
+
+    pollfd pfd[2];
+    pfd[0].fd = xkb.fd();
+    pfd[0].events = POLLIN;
+    pfd[0].revents = 0;
+    pfd[1].fd = rulesWatch;
+    pfd[1].events = POLLIN;
+    pfd[1].revents = 0;
+    int iret = poll(pfd, rulesWatch >= 0 ? 2 : 1, -1);
+    CHECK_MSG(verbose, iret >= 0 || errno == EINTR, "poll() failed: " << strerror(errno));
+    if(iret > 0 && (pfd[1].revents & POLLIN))
+      rulesWritten = rules_written(rulesWatch, rulesPath);
+  }
+
+  if(rulesWatch >= 0)
+    close(rulesWatch);
+  XSetErrorHandler(default_error_handler);
+}
+
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Per-window layout memory, driven by focus changes */
+
+#ifndef WINDOWMEMORY_HPP
+#define WINDOWMEMORY_HPP
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "XKeyboard.hpp"
+
+namespace kb {
+
+// Groups of the most recently used windows, bounded in size
+class WindowMemory
+{
+public:
+  typedef std::list<std::pair<Window, int> > lru_list;
+
+  size_t _capacity;
+  lru_list _lru;  // Most recently used first
+  std::unordered_map<Window, lru_list::iterator> _index;
+
+  WindowMemory(size_t capacity);
+
+  // Looks the window up and marks it as used, returns false if unknown
+  bool get(Window w, int& group);
+
+  // Remembers the group of the window. Returns the evicted window or None.
+  Window put(Window w, int group);
+
+  // Forgets the window
+  void erase(Window w);
+};
+
+// Remembers the group of every focused window and restores it when the
+// window gets the focus again, until SIGINT or SIGTERM arrive (or throw
+// std::runtime_error). Focus changes are tracked with _NET_ACTIVE_WINDOW.
+// Windows matching a rule of the rules file (see WindowRules.hpp) get the
+// layout of the rule instead; the file is reloaded when it changes.
+void run_per_window(XKeyboard& xkb, size_t capacity,
+                    const std::string& rulesPath = std::string());
+
+}
+
+#endif
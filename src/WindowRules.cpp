@@ -0,0 +1,306 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Implementation of the per-application layout rules */
+
+#include <cctype>
+#include <fstream>
+#include <sstream>
+
+#include <sys/stat.h>
+
+#include "WindowRules.hpp"
+#include "Utils.hpp"
+
+using namespace std;
+
+namespace kb {
+
+namespace {
+
+// dst = src << 1 across the words
+void shift_left(const GlobSet::bitset& src, GlobSet::bitset& dst)
+{
+  uint64_t carry = 0;
+  for(size_t w=0; w<src.size(); w++) {
+    dst[w] = (src[w] << 1) | carry;
+    carry = src[w] >> 63;
+  }
+}
+
+void set_bit(GlobSet::bitset& set, size_t bit)
+{
+  set[bit / 64] |= uint64_t(1) << (bit % 64);
+}
+
+int64_t modification_time(const string& path)
+{
+  struct stat st;
+  if(stat(path.c_str(), &st) != 0)
+    return -1;
+  return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+// Reads a token, a double-quoted one may contain spaces and \" escapes
+bool read_token(istream& in, string& token)
+{
+  token.clear();
+  in >> ws;
+  if(in.peek() != '"')
+    return static_cast<bool>(in >> token);
+
+  in.get();
+  char c;
+  while(in.get(c)) {
+    if(c == '"')
+      return true;
+    if(c == '\\' && !in.get(c))
+      break;
+    token += c;
+  }
+  return false;
+}
+
+}
+
+GlobSet::GlobSet()
+  : _count(0), _bits(0), _words(0)
+{
+}
+
+void GlobSet::add(const string& pattern)
+{
+  // Tokens as sets of matching characters, empty ones for *
+  vector<vector<bool> > tokens;
+  vector<bool> isStar;
+  for(size_t i=0; i<pattern.size(); i++) {
+    unsigned char c = pattern[i];
+    vector<bool> chars(256, false);
+    if(c == '*') {
+      if(!isStar.empty() && isStar.back())
+        continue;
+      tokens.push_back(chars);
+      isStar.push_back(true);
+      continue;
+    }
+    if(c == '?') {
+      chars.assign(256, true);
+    }
+    else if(c == '[') {
+      size_t j = i + 1;
+      bool negate = j < pattern.size() && (pattern[j] == '!' || pattern[j] == '^');
+      if(negate)
+        j++;
+      bool first = true;
+      while(j < pattern.size() && (pattern[j] != ']' || first)) {
+        unsigned char lo = pattern[j];
+        unsigned char hi = lo;
+        if(j + 2 < pattern.size() && pattern[j+1] == '-' && pattern[j+2] != ']') {
+          hi = pattern[j+2];
+          j += 2;
+        }
+        for(unsigned v=lo; v<=hi; v++)
+          chars[v] = true;
+        j++;
+        first = false;
+      }
+      if(j >= pattern.size())
+        throw std::runtime_error("Unterminated [ in pattern '" + pattern + "'");
+      if(negate)
+        chars.flip();
+      i = j;
+    }
+    else {
+      if(c == '\\' && i + 1 < pattern.size())
+        c = pattern[++i];
+      chars[c] = true;
+    }
+    tokens.push_back(chars);
+    isStar.push_back(false);
+  }
+
+  size_t first = _bits;
+  _bits += tokens.size() + 1;
+  _words = (_bits + 63) / 64;
+  _start.resize(_words, 0);
+  _star.resize(_words, 0);
+  _accept.resize(_words, 0);
+  for(int c=0; c<256; c++)
+    _match[c].resize(_words, 0);
+
+  _owner.resize(_bits, -1);
+
+  set_bit(_start, first);
+  for(size_t t=0; t<tokens.size(); t++) {
+    if(isStar[t]) {
+      set_bit(_star, first + t);
+      continue;
+    }
+    for(int c=0; c<256; c++) {
+      if(tokens[t][c])
+        set_bit(_match[c], first + t);
+    }
+  }
+  set_bit(_accept, first + tokens.size());
+  _owner[first + tokens.size()] = _count++;
+}
+
+int GlobSet::match(const string& str) const
+{
+  if(_words == 0)
+    return -1;
+
+  bitset active(_start);
+  bitset next(_words);
+  bitset tmp(_words);
+
+  // A * also matches no characters
+  for(size_t w=0; w<_words; w++)
+    tmp[w] = active[w] & _star[w];
+  shift_left(tmp, next);
+  for(size_t w=0; w<_words; w++)
+    active[w] |= next[w];
+
+  for(size_t i=0; i<str.size(); i++) {
+    const bitset& m = _match[static_cast<unsigned char>(str[i])];
+    uint64_t any = 0;
+    for(size_t w=0; w<_words; w++)
+      tmp[w] = active[w] & m[w];
+    shift_left(tmp, next);
+    for(size_t w=0; w<_words; w++)
+      active[w] = next[w] | (active[w] & _star[w]);
+    for(size_t w=0; w<_words; w++)
+      tmp[w] = active[w] & _star[w];
+    shift_left(tmp, next);
+    for(size_t w=0; w<_words; w++) {
+      active[w] |= next[w];
+      any |= active[w];
+    }
+    if(!any)
+      return -1;
+  }
+
+  for(size_t w=0; w<_words; w++) {
+    uint64_t a = active[w] & _accept[w];
+    if(a)
+      return _owner[w * 64 + __builtin_ctzll(a)];
+  }
+  return -1;
+}
+
+WindowRules::WindowRules(size_t verbose)
+  : _mtime(-1), _verbose(verbose)
+{
+}
+
+void WindowRules::load(const string& path)
+{
+  int64_t mtime = modification_time(path);
+  ifstream in(path.c_str());
+  CHECK_MSG(_verbose, in, "Failed to open " << path);
+
+  vector<window_rule> rules;
+  GlobSet classSet, nameSet;
+  vector<int> classRules, nameRules;
+  string line;
+  size_t lineno = 0;
+  while(getline(in, line)) {
+    lineno++;
+    istringstream iss(line);
+    string field, pattern, action;
+    iss >> ws;
+    if(iss.peek() == '#' || !(iss >> field))
+      continue;
+    CHECK_MSG(_verbose, read_token(iss, pattern) && (iss >> action),
+        path << ":" << lineno << ": expected FIELD PATTERN ACTION");
+
+    window_rule r;
+    r.pattern = pattern;
+    r.layout = action == "remember" ? string() : action;
+    try {
+      if(field == "class") {
+        r.field = window_rule::CLASS;
+        classSet.add(pattern);
+        classRules.push_back(rules.size());
+      }
+      else if(field == "name") {
+        r.field = window_rule::NAME;
+        nameSet.add(pattern);
+        nameRules.push_back(rules.size());
+      }
+      else {
+        THROW_MSG(_verbose, "unknown field '" << field << "'");
+      }
+    }
+    catch(std::exception& err) {
+      THROW_MSG(_verbose, path << ":" << lineno << ": " << err.what());
+    }
+    rules.push_back(r);
+  }
+
+  _path = path;
+  _mtime = mtime;
+  _rules.swap(rules);
+  _class = classSet;
+  _classRules.swap(classRules);
+  _name = nameSet;
+  _nameRules.swap(nameRules);
+  MSG(_verbose, "Loaded " << _rules.size() << " rules from " << path);
+}
+
+bool WindowRules::reload()
+{
+  if(_path.empty())
+    return false;
+  int64_t mtime = modification_time(_path);
+  if(mtime == _mtime)
+    return false;
+  try {
+    load(_path);
+  }
+  catch(std::exception& err) {
+    // Don't retry until the file changes again
+    _mtime = mtime;
+    cerr << "xkb-switch: " << err.what() << endl;
+    return false;
+  }
+  return true;
+}
+
+int WindowRules::match(const string& instance, const string& cls,
+                       const string& name) const
+{
+  int best = -1;
+  int i = _class.match(instance);
+  if(i >= 0)
+    best = _classRules[i];
+  i = _class.match(cls);
+  if(i >= 0 && (best < 0 || _classRules[i] < best))
+    best = _classRules[i];
+  i = _name.match(name);
+  if(i >= 0 && (best < 0 || _nameRules[i] < best))
+    best = _nameRules[i];
+  return best;
+}
+
+}
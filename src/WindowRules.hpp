@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Per-application layout rules, matched against WM_CLASS and window titles
+ *
+ * A rules file has a rule per line: FIELD PATTERN ACTION, separated by
+ * whitespace. Empty lines and lines starting with # are ignored.
+ *
+ *   class  *term*                 us
+ *   name   "* - Visual Studio*"   us
+ *   class  TelegramDesktop        remember
+ *
+ * FIELD is "class", matching either part of WM_CLASS, or "name", matching the
+ * window title. PATTERN is a glob with *, ? and [...] classes, in double
+ * quotes if it contains spaces. ACTION is a group name as printed by
+ * xkb-switch -l, a bare layout or "remember". The first matching rule wins.
+ */
+
+#ifndef WINDOWRULES_HPP
+#define WINDOWRULES_HPP
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace kb {
+
+// Set of glob patterns compiled into one bit-parallel automaton. Every
+// pattern token is a bit; a character advances all patterns at once.
+class GlobSet
+{
+public:
+  typedef std::vector<uint64_t> bitset;
+
+  int _count;               // Number of patterns
+  size_t _bits;
+  size_t _words;
+  bitset _start;             // Initial token of every pattern
+  bitset _star;              // Tokens matching any run of characters
+  bitset _accept;            // Bit after the last token of every pattern
+  std::vector<int> _owner;   // Pattern of every accepting bit
+  bitset _match[256];        // Tokens matching a character
+
+  GlobSet();
+
+  // Adds a pattern (or throw std::runtime_error). Patterns are numbered in
+  // the order of addition.
+  void add(const std::string& pattern);
+
+  // Returns the first pattern matching the whole string or -1
+  int match(const std::string& str) const;
+};
+
+struct window_rule {
+  enum field_kind { CLASS, NAME } field;
+  std::string pattern;
+  std::string layout;   // Empty for remember
+};
+
+class WindowRules
+{
+public:
+  std::string _path;
+  int64_t _mtime;       // Modification time of the loaded file, ns
+  std::vector<window_rule> _rules;
+  GlobSet _class;
+  std::vector<int> _classRules;  // Rule of every class pattern
+  GlobSet _name;
+  std::vector<int> _nameRules;
+  size_t _verbose;
+
+  WindowRules(size_t verbose);
+
+  // Loads and compiles the file (or throw std::runtime_error)
+  void load(const std::string& path);
+
+  // Loads the file again if it was modified, keeps the old rules if the new
+  // ones are invalid. Returns true if the rules changed.
+  bool reload();
+
+  bool empty() const { return _rules.empty(); }
+
+  // Returns the first rule matching the window or -1
+  int match(const std::string& instance, const std::string& cls,
+            const std::string& name) const;
+};
+
+}
+
+#endif
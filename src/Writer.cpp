@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Implementation of the buffered writer */
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+
+#include <unistd.h>
+
+#include "Writer.hpp"
+#include "Utils.hpp"
+
+namespace kb {
+
+Writer::Writer(int fd, size_t flushEvery, size_t verbose)
+  : _fd(fd), _flushEvery(flushEvery), _records(0), _used(0), _buf(4096),
+    _verbose(verbose)
+{
+}
+
+Writer::~Writer()
+{
+  try {
+    flush();
+  }
+  catch(...) {
+  }
+}
+
+void Writer::write(const char* data, size_t len)
+{
+  if(_used + len > _buf.size()) {
+    flush();
+    if(len > _buf.size())
+      _buf.resize(len);
+  }
+  std::memcpy(&_buf[_used], data, len);
+  _used += len;
+}
+
+void Writer::write(const std::string& s)
+{
+  write(s.data(), s.size());
+}
+
+void Writer::end_record()
+{
+  _records++;
+  if(_flushEvery != 0 && _records >= _flushEvery) {
+    flush();
+  }
+}
+
+void Writer::flush()
+{
+  size_t done = 0;
+  while(done < _used) {
+    ssize_t n = ::write(_fd, &_buf[done], _used - done);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0) {
+      _used = 0;
+      THROW_MSG(_verbose, "Write failed: " << strerror(errno));
+    }
+    done += n;
+  }
+  _used = 0;
+  _records = 0;
+}
+
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Buffered writer for the streaming modes */
+
+#ifndef WRITER_HPP
+#define WRITER_HPP
+
+#include <string>
+#include <vector>
+
+namespace kb {
+
+class Writer
+{
+public:
+
+  int _fd;
+  size_t _flushEvery;
+  size_t _records;
+  size_t _used;
+  std::vector<char> _buf;
+  size_t _verbose;
+
+  // Writes to the file descriptor, flushing after every flushEvery records.
+  // Zero flushEvery means flushing only when the buffer is full.
+  Writer(int fd, size_t flushEvery, size_t verbose);
+
+  // Flushes the remaining data, ignoring errors
+  ~Writer();
+
+  void write(const char* data, size_t len);
+  void write(const std::string& s);
+
+  // Marks the end of a record, flushes according to the policy
+  void end_record();
+
+  // Writes out the buffer (or throw std::runtime_error)
+  void flush();
+};
+
+}
+
+#endif
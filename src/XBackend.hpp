@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Backends performing the synchronous queries of XKeyboard
+ *
+ * A query asks for any combination of the current group, the layout and
+ * variant strings of the rules property and the fancy group names. Backends
+ * are free to send the requests together and collect the replies afterwards.
+ */
+
+#ifndef XBACKEND_HPP
+#define XBACKEND_HPP
+
+#include "XKeyboard.hpp"
+
+namespace kb {
+
+// Combined query, see XKeyboard::prefetch()
+struct xkb_query {
+  int mask;                   // QUERY_* bits to fetch
+  int group;                  // QUERY_GROUP
+  layout_variant_strings lv;  // QUERY_RULES
+  string_vector names;        // QUERY_NAMES, unnamed groups get ""
+  group_history history;      // QUERY_HISTORY
+  Atom historyAtom;           // QUERY_HISTORY, None if not interned
+
+  // Filled by the backend
+  unsigned long requests;
+  unsigned long round_trips;
+
+  xkb_query(int m) : mask(m), group(0), historyAtom(None), requests(0), round_trips(0)
+  {
+    history.count = 0;
+  }
+};
+
+class XBackend
+{
+public:
+  virtual ~XBackend() {}
+
+  // Fetches everything the mask asks for (or throw std::runtime_error)
+  virtual void query(xkb_query& q) = 0;
+};
+
+// Root window property holding the rules, model, layout, variant and options
+static const char rules_atom_name[] = "_XKB_RULES_NAMES";
+
+// Splits the rules property value into the rules, model, layout, variant and
+// options fields. Missing fields are left empty.
+void split_rules_names(const char* data, size_t length, std::string fields[5]);
+
+// Returns the layout and variant strings of the rules property value, "us"
+// if there is no layout
+layout_variant_strings parse_rules_names(const char* data, size_t length, size_t verbose);
+
+// Fills the history from the values of the property, dropping the groups
+// out of range and repeated ones
+template<class T>
+void parse_history(const T* values, size_t count, group_history& history)
+{
+  history.count = 0;
+  for(size_t i = 0; i < count && history.count < XkbNumKbdGroups; i++) {
+    int g = static_cast<int>(values[i]);
+    bool seen = g < 0 || g >= XkbNumKbdGroups;
+    for(int j = 0; j < history.count && !seen; j++)
+      seen = history.groups[j] == g;
+    if(!seen)
+      history.groups[history.count++] = g;
+  }
+}
+
+// Synchronous Xlib calls, one round trip per item
+XBackend* make_xlib_backend(const XKeyboard& xkb);
+
+#ifdef XKBSWITCH_XCB
+// XCB requests sharing the Xlib connection, all items in one round trip
+XBackend* make_xcb_backend(const XKeyboard& xkb);
+#endif
+
+}
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Implementation of the keyboard enumeration */
+
+#include <cctype>
+#include <cstdlib>
+#include <sstream>
+
+#include <X11/XKBlib.h>
+#ifdef XKBSWITCH_XINPUT
+#include <X11/extensions/XInput2.h>
+#endif
+
+#include "XDevices.hpp"
+#include "Utils.hpp"
+
+using namespace std;
+
+namespace kb {
+
+#ifdef XKBSWITCH_XINPUT
+
+void list_keyboards(const XKeyboard& xkb, device_vector& out)
+{
+  size_t verbose = xkb._verbose;
+  CHECK(verbose, xkb._display != 0);
+
+  int major = 2;
+  int minor = 0;
+  CHECK_MSG(verbose, XIQueryVersion(xkb._display, &major, &minor) == Success,
+      "XInput 2 is not supported by the X server");
+
+  int count = 0;
+  XIDeviceInfo* info = XIQueryDevice(xkb._display, XIAllDevices, &count);
+  CHECK_MSG(verbose, info != NULL, "Failed to query input devices");
+
+  out.clear();
+  for(int i = 0; i < count; i++) {
+    if(info[i].use != XIMasterKeyboard && info[i].use != XISlaveKeyboard)
+      continue;
+    device_info d;
+    d.id = info[i].deviceid;
+    d.name = info[i].name ? info[i].name : "";
+    d.master = info[i].use == XIMasterKeyboard;
+    out.push_back(d);
+  }
+  XIFreeDeviceInfo(info);
+}
+
+#else
+
+void list_keyboards(const XKeyboard& xkb, device_vector& out)
+{
+  size_t verbose = xkb._verbose;
+  CHECK(verbose, xkb._display != 0);
+
+  // XKB alone can only describe the devices it is asked about
+  XkbDeviceInfoPtr info = XkbGetDeviceInfo(xkb._display, 0, XkbUseCoreKbd, 0, 0);
+  CHECK_MSG(verbose, info != NULL, "Failed to get the core keyboard description");
+
+  device_info d;
+  d.id = info->device_spec;
+  d.name = info->name ? info->name : "";
+  d.master = true;
+  XkbFreeDeviceInfo(info, XkbXI_AllDeviceFeaturesMask, True);
+
+  out.clear();
+  out.push_back(d);
+}
+
+#endif
+
+int find_keyboard(const XKeyboard& xkb, const string& spec)
+{
+  size_t verbose = xkb._verbose;
+  CHECK_MSG(verbose, !spec.empty(), "Empty device name");
+
+  bool numeric = true;
+  for(size_t i = 0; i < spec.size(); i++) {
+    if(!isdigit(static_cast<unsigned char>(spec[i])))
+      numeric = false;
+  }
+  if(numeric)
+    return atoi(spec.c_str());
+
+  device_vector devices;
+  list_keyboards(xkb, devices);
+  for(size_t i = 0; i < devices.size(); i++) {
+    if(devices[i].name == spec)
+      return devices[i].id;
+  }
+  THROW_MSG(verbose, "Keyboard '" << spec << "' not found. Try xkb-switch --list-devices.");
+}
+
+}
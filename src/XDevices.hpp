@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Enumeration of the keyboards known to the X server */
+
+#ifndef XDEVICES_HPP
+#define XDEVICES_HPP
+
+#include <string>
+#include <vector>
+
+#include "XKeyboard.hpp"
+
+namespace kb {
+
+struct device_info {
+  int id;             // XKB/XInput device id
+  std::string name;
+  bool master;        // Master (virtual core) keyboard
+};
+
+typedef std::vector<device_info> device_vector;
+
+// Lists master and physical keyboards. Without XInput support only the core
+// keyboard is listed (or throw std::runtime_error).
+void list_keyboards(const XKeyboard& xkb, device_vector& out);
+
+// Resolves a keyboard name or numeric id to the device id (or throw
+// std::runtime_error)
+int find_keyboard(const XKeyboard& xkb, const std::string& spec);
+
+}
+
+#endif
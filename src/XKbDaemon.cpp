@@ -0,0 +1,395 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Implementation of the xkb-switch daemon and its client */
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+
+#include <map>
+#include <string>
+#include <sstream>
+#include <vector>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <X11/XKBlib.h>
+
+#include "XKbDaemon.hpp"
+#include "StatusShm.hpp"
+#include "KeymapStore.hpp"
+#include "Writer.hpp"
+#include "Utils.hpp"
+
+using namespace std;
+
+namespace kb {
+
+namespace {
+
+volatile sig_atomic_t stop_requested = 0;
+
+void on_stop_signal(int)
+{
+  stop_requested = 1;
+}
+
+// Maximum length of a request line, longer requests drop the client
+const size_t max_request = 4096;
+
+bool fill_address(sockaddr_un& addr, const string& path)
+{
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(path.size() >= sizeof(addr.sun_path))
+    return false;
+  std::memcpy(addr.sun_path, path.c_str(), path.size());
+  return true;
+}
+
+// Sends the whole reply line, returns false if the client is gone
+bool send_line(int fd, const string& line)
+{
+  string msg = line + "\n";
+  const char* p = msg.c_str();
+  size_t left = msg.size();
+  while(left > 0) {
+    ssize_t n = send(fd, p, left, MSG_NOSIGNAL);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n <= 0)
+      return false;
+    p += n;
+    left -= n;
+  }
+  return true;
+}
+
+}
+
+string daemon_socket_path(size_t verbose)
+{
+  return runtime_file_path(".sock", verbose);
+}
+
+Session::Session(XKeyboard& xkb)
+  : _xkb(xkb), _flush(true)
+{
+}
+
+string Session::execute(const string& line)
+{
+  try {
+    istringstream iss(line);
+    string cmd, arg;
+    iss >> cmd >> ws;
+    getline(iss, arg);
+
+    if(cmd == "get") {
+      return "OK " + _xkb.layout().at(_xkb.get_group());
+    }
+    else if(cmd == "fancy") {
+      return "OK " + _xkb.get_long_group_name();
+    }
+    else if(cmd == "list") {
+      const string_vector& sv = _xkb.layout();
+      string reply("OK");
+      for(size_t i=0; i<sv.size(); i++) {
+        reply += " " + sv[i];
+      }
+      return reply;
+    }
+    else if(cmd == "names") {
+      const string_vector& names = _xkb.group_names();
+      string reply("OK ");
+      for(size_t i=0; i<names.size(); i++) {
+        if(i > 0)
+          reply += "\t";
+        reply += names[i];
+      }
+      return reply;
+    }
+    else if(cmd == "set" || cmd == "load") {
+      const LayoutTable& table = _xkb.layout_table();
+      CHECK_MSG(_xkb._verbose, !arg.empty(), "Argument expected");
+      int group = table.lookup(arg);
+      if(group < 0 && cmd == "load") {
+        // Not among the loaded groups, rebuild the keymap with it
+        group = KeymapStore(_xkb).load(arg);
+      }
+      CHECK_MSG(_xkb._verbose, group >= 0,
+        "Group '" << arg << "' is not supported by current layout. Try xkb-switch -l.");
+      _xkb.set_group(group, _flush);
+      const char* name = _xkb.layout_table().name(group);
+      CHECK_MSG(_xkb._verbose, name != NULL, "Group " << group << " has no name");
+      return string("OK ") + name;
+    }
+    else if(cmd == "next") {
+      const LayoutTable& table = _xkb.layout_table();
+      CHECK_MSG(_xkb._verbose, !table.empty(), "No layout groups configured");
+      const char* current = table.name(_xkb.get_group());
+      CHECK_MSG(_xkb._verbose, current != NULL, "Group " << _xkb.get_group() << " is out of range");
+      int group = (table.find(current) + 1) % table.size();
+      _xkb.set_group(group, _flush);
+      return string("OK ") + table.name(group);
+    }
+    THROW_MSG(_xkb._verbose, "Unknown command '" << cmd << "'");
+  }
+  catch(std::exception& err) {
+    return string("ERR ") + err.what();
+  }
+}
+
+void run_daemon(XKeyboard& xkb, const string& path)
+{
+  size_t verbose = xkb._verbose;
+  Display* dpy = xkb._display;
+  CHECK(verbose, dpy != 0);
+  CHECK_MSG(verbose, !path.empty(), "Unable to determine the daemon socket path");
+
+  {
+    DaemonClient probe(verbose);
+    CHECK_MSG(verbose, !probe.connect(path),
+      "Another daemon is already listening on " << path);
+  }
+
+  sockaddr_un addr;
+  CHECK_MSG(verbose, fill_address(addr, path), "Socket path is too long: " << path);
+  unlink(path.c_str());
+
+  int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  CHECK_MSG(verbose, lfd >= 0, "socket() failed: " << strerror(errno));
+
+  mode_t mask = umask(077);
+  int iret = bind(lfd, (sockaddr*)&addr, sizeof(addr));
+  umask(mask);
+  if(iret != 0 || listen(lfd, 16) != 0) {
+    int err = errno;
+    close(lfd);
+    THROW_MSG(verbose, "Failed to listen on " << path << ": " << strerror(err));
+  }
+  MSG(verbose, "Listening on " << path);
+
+  xkb.enable_cache();
+
+  struct sigaction sa;
+  std::memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_stop_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  Session session(xkb);
+  map<int, string> clients;
+  vector<pollfd> fds;
+
+  while(!stop_requested) {
+    xkb.process_events();
+
+    fds.clear();
+    pollfd pfd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    pfd.fd = lfd;
+    fds.push_back(pfd);
+    pfd.fd = ConnectionNumber(dpy);
+    fds.push_back(pfd);
+    for(map<int,string>::const_iterator i=clients.begin(); i!=clients.end(); i++) {
+      pfd.fd = i->first;
+      fds.push_back(pfd);
+    }
+
+    if(poll(&fds[0], fds.size(), -1) < 0) {
+      if(errno == EINTR)
+        continue;
+      THROW_MSG(verbose, "poll() failed: " << strerror(errno));
+    }
+
+    if(fds[0].revents & POLLIN) {
+      int cfd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if(cfd >= 0)
+        clients[cfd] = "";
+    }
+
+    for(size_t k=2; k<fds.size(); k++) {
+      if(fds[k].revents == 0)
+        continue;
+      int cfd = fds[k].fd;
+      string& buf = clients[cfd];
+      bool alive = true;
+
+      char chunk[512];
+      ssize_t n = read(cfd, chunk, sizeof(chunk));
+      if(n > 0) {
+        buf.append(chunk, n);
+      }
+      else if(n == 0 || (errno != EINTR && errno != EAGAIN)) {
+        alive = false;
+      }
+
+      size_t eol;
+      while(alive && (eol = buf.find('\n')) != string::npos) {
+        string line = buf.substr(0, eol);
+        buf.erase(0, eol + 1);
+        if(!line.empty() && line[line.size()-1] == '\r')
+          line.erase(line.size()-1);
+        MSG(verbose, "Request \"" << line << "\"");
+        alive = send_line(cfd, session.execute(line));
+      }
+
+      if(!alive || buf.size() > max_request) {
+        close(cfd);
+        clients.erase(cfd);
+      }
+    }
+  }
+
+  for(map<int,string>::const_iterator i=clients.begin(); i!=clients.end(); i++) {
+    close(i->first);
+  }
+  close(lfd);
+  unlink(path.c_str());
+}
+
+void run_batch(XKeyboard& xkb, int in, int out)
+{
+  size_t verbose = xkb._verbose;
+  xkb.enable_cache();
+
+  Session session(xkb);
+  session._flush = false;
+  Writer writer(out, 0, verbose);
+  string buf;
+
+  while(true) {
+    char chunk[4096];
+    ssize_t n = read(in, chunk, sizeof(chunk));
+    if(n < 0 && errno == EINTR)
+      continue;
+    CHECK_MSG(verbose, n >= 0, "Failed to read commands: " << strerror(errno));
+    if(n == 0)
+      break;
+    buf.append(chunk, n);
+
+    size_t eol;
+    while((eol = buf.find('\n')) != string::npos) {
+      string line = buf.substr(0, eol);
+      buf.erase(0, eol + 1);
+      if(!line.empty() && line[line.size()-1] == '\r')
+        line.erase(line.size()-1);
+      if(line.empty())
+        continue;
+
+      if(line == "wait") {
+        xkb.flush();
+        writer.flush();
+        xkb.wait_event(-1, EVENT_STATE);
+        line = "get";
+      }
+      writer.write(session.execute(line));
+      writer.write("\n", 1);
+    }
+
+    xkb.flush();
+    writer.flush();
+  }
+}
+
+DaemonClient::DaemonClient(size_t verbose)
+  : _fd(-1), _verbose(verbose)
+{
+}
+
+DaemonClient::~DaemonClient()
+{
+  if(_fd >= 0)
+    close(_fd);
+}
+
+bool DaemonClient::connect(const string& path)
+{
+  sockaddr_un addr;
+  if(path.empty() || !fill_address(addr, path))
+    return false;
+
+  // Only talk to a daemon started by the same user
+  struct stat st;
+  if(stat(path.c_str(), &st) != 0 || !S_ISSOCK(st.st_mode) || st.st_uid != getuid())
+    return false;
+
+  _fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(_fd < 0)
+    return false;
+
+  if(::connect(_fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+    MSG(_verbose, "No daemon at " << path << ": " << strerror(errno));
+    close(_fd);
+    _fd = -1;
+    return false;
+  }
+
+  timeval tv;
+  tv.tv_sec = 2;
+  tv.tv_usec = 0;
+  setsockopt(_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  MSG(_verbose, "Connected to daemon at " << path);
+  return true;
+}
+
+string DaemonClient::request(const string& cmd)
+{
+  CHECK(_verbose, _fd >= 0);
+  CHECK_MSG(_verbose, send_line(_fd, cmd), "Failed to send request to the daemon");
+
+  size_t eol;
+  while((eol = _buf.find('\n')) == string::npos) {
+    char chunk[512];
+    ssize_t n = read(_fd, chunk, sizeof(chunk));
+    if(n < 0 && errno == EINTR)
+      continue;
+    CHECK_MSG(_verbose, n > 0, "Daemon closed the connection");
+    _buf.append(chunk, n);
+  }
+
+  string reply = _buf.substr(0, eol);
+  _buf.erase(0, eol + 1);
+  MSG(_verbose, "Daemon replied \"" << reply << "\"");
+
+  if(reply.compare(0, 3, "OK ") == 0)
+    return reply.substr(3);
+  if(reply == "OK")
+    return "";
+  if(reply.compare(0, 4, "ERR ") == 0)
+    THROW_MSG(_verbose, reply.substr(4));
+  THROW_MSG(_verbose, "Malformed daemon reply \"" << reply << "\"");
+}
+
+}
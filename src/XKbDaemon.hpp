@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Daemon keeping one XKeyboard open and serving thin clients over a Unix
+ * socket, and the batch mode speaking the same protocol over stdin/stdout.
+ *
+ * The protocol is line-based. Every request is a single line, every reply is
+ * a single line starting with either "OK" or "ERR":
+ *
+ *   get        -> OK <layout>
+ *   fancy      -> OK <fancy layout name>
+ *   set NAME   -> OK <layout>
+ *   next       -> OK <layout>
+ *   list       -> OK <layout1> <layout2> ...
+ *   names      -> OK <fancy name1>\t<fancy name2>...
+ *   wait       -> OK <layout>, once the group changes (batch mode only)
+ */
+
+#ifndef XKBDAEMON_HPP
+#define XKBDAEMON_HPP
+
+#include <string>
+
+#include "XKeyboard.hpp"
+
+namespace kb {
+
+// Returns the per-user, per-display socket path or an empty string if it
+// can't be determined (e.g. $DISPLAY is not set).
+std::string daemon_socket_path(size_t verbose);
+
+// Executes protocol commands against a single XKeyboard. Enable the
+// XKeyboard cache to keep the layout table resident between the calls.
+class Session
+{
+public:
+
+  XKeyboard& _xkb;
+  bool _flush;  // Flush every set request immediately
+
+  Session(XKeyboard& xkb);
+
+  // Executes one command line, returns the reply line (without newline)
+  std::string execute(const std::string& line);
+};
+
+// Serves clients until SIGINT or SIGTERM arrive (or throw std::runtime_error)
+void run_daemon(XKeyboard& xkb, const std::string& path);
+
+// Executes commands read from the input descriptor and writes replies to the
+// output one until the end of input. Requests are pipelined: X requests and
+// replies are flushed once all the commands received so far are executed.
+void run_batch(XKeyboard& xkb, int in, int out);
+
+class DaemonClient
+{
+public:
+
+  int _fd;
+  size_t _verbose;
+  std::string _buf;
+
+  DaemonClient(size_t verbose);
+  ~DaemonClient();
+
+  // Connects to the daemon, returns false if no daemon is listening
+  bool connect(const std::string& path);
+
+  // Sends a command and returns its reply (or throw std::runtime_error)
+  std::string request(const std::string& cmd);
+};
+
+}
+
+#endif
@@ -0,0 +1,326 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Implementation of the multi-display monitor */
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+
+#include <list>
+#include <sstream>
+#include <string>
+
+#include <glob.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include <X11/Xlib.h>
+
+#include "XKbMonitor.hpp"
+#include "Utils.hpp"
+
+using namespace std;
+
+namespace kb {
+
+namespace {
+
+volatile sig_atomic_t stop_requested = 0;
+
+void on_stop_signal(int)
+{
+  stop_requested = 1;
+}
+
+// Reconnection backoff and the period of the pattern rescans
+const long min_retry_ms = 500;
+const long max_retry_ms = 30000;
+const long rescan_ms = 5000;
+
+// Directory of the local X server sockets
+const char* x11_socket_prefix = "/tmp/.X11-unix/X";
+
+long now_ms()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+bool is_pattern(const string& spec)
+{
+  return spec.find_first_of("*?[") != string::npos;
+}
+
+// Returns local display names matching the pattern, like ":1*"
+string_vector expand_pattern(const string& pattern, size_t verbose)
+{
+  CHECK_MSG(verbose, !pattern.empty() && pattern[0] == ':',
+      "Only local displays may be given as patterns: '" << pattern << "'");
+
+  string_vector names;
+  glob_t g;
+  std::memset(&g, 0, sizeof(g));
+  if(glob((x11_socket_prefix + pattern.substr(1)).c_str(), 0, NULL, &g) == 0) {
+    size_t prefix = strlen(x11_socket_prefix);
+    for(size_t i = 0; i < g.gl_pathc; i++)
+      names.push_back(string(":") + (g.gl_pathv[i] + prefix));
+  }
+  globfree(&g);
+  return names;
+}
+
+struct display_slot {
+  string name;
+  bool given;             // Given explicitly rather than found by a pattern
+  XKeyboard* xkb;
+  GroupStream stream;
+  bool ioError;           // Set by the Xlib IO error exit handler
+  long delay;             // Current reconnection backoff
+  long retryAt;           // Time of the next connection attempt
+
+  display_slot(const string& n, bool g, const GroupStream& s)
+    : name(n), given(g), xkb(NULL), stream(s), ioError(false),
+      delay(min_retry_ms), retryAt(0) {}
+};
+
+#ifdef HAVE_XSETIOERROREXITHANDLER
+// Keeps Xlib from exiting the process when a single display is lost
+void on_io_error_exit(Display*, void* data)
+{
+  static_cast<display_slot*>(data)->ioError = true;
+}
+#endif
+
+class Monitor
+{
+public:
+  stream_format _format;
+  int _fancy;
+  Writer& _out;
+  size_t _verbose;
+  int _epoll;
+  string_vector _patterns;
+  list<display_slot> _slots;
+
+  Monitor(stream_format format, int fancy, Writer& out, size_t verbose)
+    : _format(format), _fancy(fancy), _out(out), _verbose(verbose), _epoll(-1)
+  {
+    _epoll = epoll_create1(EPOLL_CLOEXEC);
+    CHECK_MSG(verbose, _epoll >= 0, "epoll_create1() failed: " << strerror(errno));
+  }
+
+  ~Monitor()
+  {
+    for(list<display_slot>::iterator i = _slots.begin(); i != _slots.end(); ++i)
+      delete i->xkb;
+    close(_epoll);
+  }
+
+  void add(const string& name, bool given)
+  {
+    for(list<display_slot>::iterator i = _slots.begin(); i != _slots.end(); ++i) {
+      if(i->name == name) {
+        i->given = i->given || given;
+        return;
+      }
+    }
+    ostringstream json;
+    json << ",\"display\":\"" << json_escape(name) << "\"";
+    _slots.push_back(display_slot(name, given,
+        GroupStream(_format, _fancy, name + "\t", json.str(), _verbose)));
+  }
+
+  // Adds the displays matching the patterns, drops the disconnected ones
+  // whose sockets are gone
+  void rescan()
+  {
+    string_vector found;
+    for(size_t i = 0; i < _patterns.size(); i++) {
+      string_vector names = expand_pattern(_patterns[i], _verbose);
+      found.insert(found.end(), names.begin(), names.end());
+    }
+    for(size_t i = 0; i < found.size(); i++)
+      add(found[i], false);
+
+    list<display_slot>::iterator i = _slots.begin();
+    while(i != _slots.end()) {
+      if(!i->given && i->xkb == NULL &&
+         std::find(found.begin(), found.end(), i->name) == found.end()) {
+        MSG(_verbose, "Display " << i->name << " is gone");
+        i = _slots.erase(i);
+      }
+      else {
+        ++i;
+      }
+    }
+  }
+
+  void connect(display_slot& s)
+  {
+    XKeyboard* xkb = new XKeyboard(_verbose);
+    try {
+      xkb->open_display(s.name);
+#ifdef HAVE_XSETIOERROREXITHANDLER
+      XSetIOErrorExitHandler(xkb->_display, on_io_error_exit, &s);
+#endif
+      xkb->enable_cache();
+
+      epoll_event ev;
+      std::memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN;
+      ev.data.ptr = &s;
+      CHECK_MSG(_verbose, epoll_ctl(_epoll, EPOLL_CTL_ADD, xkb->fd(), &ev) == 0,
+          "epoll_ctl() failed: " << strerror(errno));
+    }
+    catch(std::exception& err) {
+      MSG(_verbose, "Display " << s.name << ": " << err.what());
+      delete xkb;
+      s.retryAt = now_ms() + s.delay;
+      s.delay = std::min(s.delay * 2, max_retry_ms);
+      return;
+    }
+
+    MSG(_verbose, "Connected to display " << s.name);
+    s.xkb = xkb;
+    s.ioError = false;
+    s.delay = min_retry_ms;
+    s.stream.reset();
+    update(s);
+  }
+
+  void disconnect(display_slot& s)
+  {
+    MSG(_verbose, "Lost display " << s.name);
+    epoll_ctl(_epoll, EPOLL_CTL_DEL, s.xkb->fd(), NULL);
+    delete s.xkb;
+    s.xkb = NULL;
+    s.retryAt = now_ms() + s.delay;
+    s.delay = std::min(s.delay * 2, max_retry_ms);
+  }
+
+  // Handles the received events, reports the group if it changed
+  void update(display_slot& s)
+  {
+    try {
+      do {
+        s.stream.update(*s.xkb, s.xkb->get_group(), _out);
+      } while(!s.ioError && XQLength(s.xkb->_display) > 0);
+    }
+    catch(std::exception& err) {
+      MSG(_verbose, "Display " << s.name << ": " << err.what());
+      s.ioError = true;
+    }
+    if(s.ioError)
+      disconnect(s);
+  }
+
+  void run()
+  {
+    long rescanAt = 0;
+    const int max_events = 64;
+    epoll_event events[max_events];
+
+    while(!stop_requested) {
+      long now = now_ms();
+      if(!_patterns.empty() && now >= rescanAt) {
+        rescan();
+        rescanAt = now + rescan_ms;
+      }
+
+      long timeout = _patterns.empty() ? -1 : rescanAt - now;
+      for(list<display_slot>::iterator i = _slots.begin(); i != _slots.end(); ++i) {
+        if(i->xkb)
+          continue;
+        if(i->retryAt <= now)
+          connect(*i);
+        if(!i->xkb) {
+          long left = std::max(i->retryAt - now, 0L);
+          timeout = timeout < 0 ? left : std::min(timeout, left);
+        }
+      }
+      _out.flush();
+
+      int n = epoll_wait(_epoll, events, max_events, timeout);
+      if(n < 0 && errno == EINTR)
+        continue;
+      CHECK_MSG(_verbose, n >= 0, "epoll_wait() failed: " << strerror(errno));
+
+      for(int i = 0; i < n; i++) {
+        display_slot& s = *static_cast<display_slot*>(events[i].data.ptr);
+        if(events[i].events & (EPOLLHUP | EPOLLERR))
+          s.ioError = true;
+        if(s.xkb)
+          update(s);
+      }
+    }
+  }
+};
+
+}
+
+string_vector parse_display_list(const string& list)
+{
+  string_vector out;
+  istringstream iss(list);
+  string name;
+  while(getline(iss, name, ',')) {
+    if(!name.empty())
+      out.push_back(name);
+  }
+  return out;
+}
+
+void run_monitor(const string_vector& specs, stream_format format, int fancy,
+                 Writer& out, size_t verbose)
+{
+  CHECK_MSG(verbose, !specs.empty(), "No displays given");
+#ifndef HAVE_XSETIOERROREXITHANDLER
+  // Older Xlib exits the process once any of the displays is lost
+  THROW_MSG(verbose, "--displays needs libX11 1.7 or newer");
+#endif
+
+  Monitor monitor(format, fancy, out, verbose);
+  for(size_t i = 0; i < specs.size(); i++) {
+    if(is_pattern(specs[i])) {
+      monitor._patterns.push_back(specs[i]);
+    }
+    else {
+      monitor.add(specs[i], true);
+    }
+  }
+
+  struct sigaction sa;
+  std::memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_stop_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  monitor.run();
+  out.flush();
+}
+
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Watching the layout groups of many X displays from one process */
+
+#ifndef XKBMONITOR_HPP
+#define XKBMONITOR_HPP
+
+#include <string>
+
+#include "XKeyboard.hpp"
+#include "Stream.hpp"
+#include "Writer.hpp"
+
+namespace kb {
+
+// Splits a comma-separated list of display names and patterns
+string_vector parse_display_list(const std::string& list);
+
+// Streams the group changes of all the displays, tagged by display name,
+// until SIGINT or SIGTERM arrive. Local displays may be given as patterns
+// like ":1*", matched against the X server sockets and rescanned
+// periodically. Lost displays are reconnected with exponential backoff
+// without disturbing the others.
+void run_monitor(const string_vector& specs, stream_format format, int fancy,
+                 Writer& out, size_t verbose);
+
+}
+
+#endif
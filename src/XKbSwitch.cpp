@@ -25,12 +25,28 @@
 
 #include <X11/XKBlib.h>
 
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <algorithm>
 #include <sstream>
 #include <getopt.h>
+#include <unistd.h>
 
 #include "XKeyboard.hpp"
+#include "XKbDaemon.hpp"
+#include "Writer.hpp"
+#include "Stream.hpp"
+#include "XDevices.hpp"
+#include "XKbMonitor.hpp"
+#include "WindowMemory.hpp"
+#include "EventLog.hpp"
+#include "GroupHistory.hpp"
+#include "StatusShm.hpp"
+#include "KeymapStore.hpp"
+#include "TextConverter.hpp"
 #include "Utils.hpp"
 
 using namespace std;
@@ -38,16 +54,95 @@ using namespace kb;
 
 void usage()
 {
-  cerr << "Usage: xkb-switch -s ARG            Sets current layout group to ARG" << endl;
-  cerr << "       xkb-switch -l|--list         Displays all layout groups" << endl;
+  cerr << "Usage: xkb-switch -s ARG [--load] [--timeout MS]" << endl;
+  cerr << "                                    Sets current layout group to ARG, --load loads it if needed" << endl;
+  cerr << "       xkb-switch -l|--list [-f]    Displays all layout groups" << endl;
   cerr << "       xkb-switch -h|--help         Displays this message" << endl;
   cerr << "       xkb-switch -v|--version      Shows version number" << endl;
-  cerr << "       xkb-switch -w|--wait [-p]    Waits for group change" << endl;
-  cerr << "       xkb-switch -W                Infinitely waits for group change, prints group names to stdout" << endl;
-  cerr << "       xkb-switch -n|--next         Switch to the next layout group" << endl;
+  cerr << "       xkb-switch -w|--wait [-p] [--timeout MS]" << endl;
+  cerr << "                                    Waits for group change, exits with 1 on timeout" << endl;
+  cerr << "       xkb-switch -W [--flush N] [--format text|jsonl|binary]" << endl;
+  cerr << "                                    Infinitely waits for group change, prints group names to stdout" << endl;
+  cerr << "       xkb-switch -n|--next [--timeout MS]" << endl;
+  cerr << "                                    Switch to the next layout group" << endl;
+  cerr << "       xkb-switch --toggle [PRIMARY] [--timeout MS]" << endl;
+  cerr << "                                    Switches to PRIMARY or back to the most recently used group" << endl;
+  cerr << "       xkb-switch --mru N [--timeout MS]" << endl;
+  cerr << "                                    Switches to the N-th most recently used group" << endl;
   cerr << "       xkb-switch -d|--debug        Print debug information" << endl;
   cerr << "       xkb-switch [-p]              Displays current layout group" << endl;
   cerr << "       xkb-switch -f|--fancy        Displays fancy name of current layout group" << endl;
+  cerr << "       xkb-switch --daemon          Serves other xkb-switch calls over a Unix socket" << endl;
+  cerr << "       xkb-switch --batch           Executes daemon protocol commands read from stdin" << endl;
+  cerr << "       xkb-switch --per-window [--rules FILE]" << endl;
+  cerr << "                                    Remembers the layout group of every window and restores it on focus" << endl;
+  cerr << "       xkb-switch --list-devices    Displays keyboard devices" << endl;
+  cerr << "       xkb-switch ... --device DEV  Uses keyboard DEV (name or id) instead of the core one" << endl;
+  cerr << "       xkb-switch -W --all-devices  Waits for group changes of all keyboards" << endl;
+  cerr << "       xkb-switch -W --displays LIST" << endl;
+  cerr << "                                    Waits for group changes on all displays in LIST (e.g. :1,:2 or ':*')" << endl;
+  cerr << "       xkb-switch -W --record FILE  Also writes the keyboard events to FILE" << endl;
+  cerr << "       xkb-switch --convert FROM TO Retypes text from stdin typed in layout FROM as if typed in TO" << endl;
+  cerr << "       xkb-switch [-W] --publish-shm" << endl;
+  cerr << "                                    Publishes the current group to a shared status file" << endl;
+  cerr << "       xkb-switch --read-shm [-f|-l] [-w [--timeout MS]]" << endl;
+  cerr << "                                    Displays the published group without connecting to X" << endl;
+  cerr << "       xkb-switch ... --stats       Prints X request statistics on exit (and on SIGUSR1 with -W)" << endl;
+}
+
+// Default time to wait for the server to confirm -s and -n
+const int SET_CONFIRM_TIMEOUT_MS = 1000;
+
+// Long-only options
+enum {
+  OPT_DAEMON = 256,
+  OPT_FLUSH,
+  OPT_TIMEOUT,
+  OPT_FORMAT,
+  OPT_STATS,
+  OPT_BATCH,
+  OPT_DEVICE,
+  OPT_LIST_DEVICES,
+  OPT_ALL_DEVICES,
+  OPT_DISPLAYS,
+  OPT_PER_WINDOW,
+  OPT_RECORD,
+  OPT_RULES,
+  OPT_TOGGLE,
+  OPT_MRU,
+  OPT_PUBLISH_SHM,
+  OPT_READ_SHM,
+  OPT_CONVERT,
+  OPT_LOAD,
+};
+
+// Number of windows --per-window remembers
+const size_t PER_WINDOW_CAPACITY = 1024;
+
+// Prints the X request statistics when leaving the scope
+struct stats_guard {
+  const XKeyboard& xkb;
+  bool enabled;
+  stats_guard(const XKeyboard& x, bool e) : xkb(x), enabled(e) {}
+  ~stats_guard() {
+    if(enabled)
+      print_stats(cerr, xkb.stats());
+  }
+};
+
+volatile sig_atomic_t stats_requested = 0;
+
+void on_stats_signal(int)
+{
+  stats_requested = 1;
+}
+
+void print_requested_stats(const XKeyboard& xkb)
+{
+  if(stats_requested) {
+    stats_requested = 0;
+    print_stats(cerr, xkb.stats());
+  }
 }
 
 string get_all_layouts(const string_vector& sv)
@@ -78,6 +173,7 @@ std::string get_layout_group_name(const XKeyboard &xkb, const string_vector &sym
 int main( int argc, char* argv[] )
 {
   size_t verbose = 1;
+  LayoutTable table;
   string_vector syms;
   bool syms_collected = false;
 
@@ -89,6 +185,28 @@ int main( int argc, char* argv[] )
     int m_next = 0;
     int m_list = 0;
     int m_fancy = 0;
+    int m_daemon = 0;
+    int m_stats = 0;
+    int m_batch = 0;
+    int m_list_devices = 0;
+    int m_all_devices = 0;
+    string m_device;
+    string m_displays;
+    int m_per_window = 0;
+    string m_record;
+    string m_rules;
+    int m_toggle = 0;
+    string m_primary;
+    int m_mru = 0;
+    int m_publish_shm = 0;
+    int m_read_shm = 0;
+    int m_convert = 0;
+    string m_convert_from;
+    string m_convert_to;
+    int m_load = 0;
+    int m_flush = 1;
+    int m_timeout = -1;
+    stream_format m_format = FORMAT_TEXT;
     int opt;
     int option_index = 0;
     string newgrp;
@@ -104,6 +222,25 @@ int main( int argc, char* argv[] )
             {"help", no_argument, NULL, 'h'},
             {"debug", no_argument, NULL, 'd'},
             {"fancy", no_argument, NULL, 'f'},
+            {"daemon", no_argument, NULL, OPT_DAEMON},
+            {"flush", required_argument, NULL, OPT_FLUSH},
+            {"timeout", required_argument, NULL, OPT_TIMEOUT},
+            {"format", required_argument, NULL, OPT_FORMAT},
+            {"stats", no_argument, NULL, OPT_STATS},
+            {"batch", no_argument, NULL, OPT_BATCH},
+            {"device", required_argument, NULL, OPT_DEVICE},
+            {"list-devices", no_argument, NULL, OPT_LIST_DEVICES},
+            {"all-devices", no_argument, NULL, OPT_ALL_DEVICES},
+            {"displays", required_argument, NULL, OPT_DISPLAYS},
+            {"per-window", no_argument, NULL, OPT_PER_WINDOW},
+            {"record", required_argument, NULL, OPT_RECORD},
+            {"rules", required_argument, NULL, OPT_RULES},
+            {"toggle", optional_argument, NULL, OPT_TOGGLE},
+            {"mru", required_argument, NULL, OPT_MRU},
+            {"publish-shm", no_argument, NULL, OPT_PUBLISH_SHM},
+            {"read-shm", no_argument, NULL, OPT_READ_SHM},
+            {"convert", required_argument, NULL, OPT_CONVERT},
+            {"load", no_argument, NULL, OPT_LOAD},
             {NULL, 0, NULL, 0},
     };
     while ((opt = getopt_long(argc, argv, "s:lvwWpnhdf",
@@ -147,6 +284,79 @@ int main( int argc, char* argv[] )
       case 'f':
         m_fancy++;
         break;
+      case OPT_DAEMON:
+        m_daemon = 1;
+        break;
+      case OPT_FLUSH:
+        m_flush = atoi(optarg);
+        CHECK_MSG(verbose, m_flush >= 0, "Invalid --flush argument");
+        break;
+      case OPT_TIMEOUT:
+        m_timeout = atoi(optarg);
+        CHECK_MSG(verbose, m_timeout >= 0, "Invalid --timeout argument");
+        break;
+      case OPT_FORMAT:
+        m_format = parse_stream_format(optarg, verbose);
+        break;
+      case OPT_STATS:
+        m_stats = 1;
+        break;
+      case OPT_BATCH:
+        m_batch = 1;
+        break;
+      case OPT_DEVICE:
+        m_device = optarg;
+        break;
+      case OPT_LIST_DEVICES:
+        m_list_devices = 1;
+        m_cnt++;
+        break;
+      case OPT_ALL_DEVICES:
+        m_all_devices = 1;
+        break;
+      case OPT_DISPLAYS:
+        m_displays = optarg;
+        break;
+      case OPT_PER_WINDOW:
+        m_per_window = 1;
+        m_cnt++;
+        break;
+      case OPT_RECORD:
+        m_record = optarg;
+        break;
+      case OPT_RULES:
+        m_rules = optarg;
+        break;
+      case OPT_TOGGLE:
+        m_toggle = 1;
+        m_cnt++;
+        // Accept "--toggle us" as well as "--toggle=us"
+        if(optarg)
+          m_primary = optarg;
+        else if(optind < argc && argv[optind][0] != '-')
+          m_primary = argv[optind++];
+        break;
+      case OPT_MRU:
+        m_mru = atoi(optarg);
+        CHECK_MSG(verbose, m_mru > 0, "Invalid --mru argument");
+        m_cnt++;
+        break;
+      case OPT_PUBLISH_SHM:
+        m_publish_shm = 1;
+        break;
+      case OPT_READ_SHM:
+        m_read_shm = 1;
+        break;
+      case OPT_CONVERT:
+        CHECK_MSG(verbose, optind < argc, "Two layouts expected, e.g. --convert us ru");
+        m_convert = 1;
+        m_convert_from = optarg;
+        m_convert_to = argv[optind++];
+        m_cnt++;
+        break;
+      case OPT_LOAD:
+        m_load = 1;
+        break;
       case '?':
         THROW_MSG(verbose, "Invalid arguments. Check --help.");
         break;
@@ -160,50 +370,286 @@ int main( int argc, char* argv[] )
       cerr << "[DEBUG] xkb-switch version " << XKBSWITCH_VERSION << endl;
     }
 
-    if(m_list || m_lwait || !newgrp.empty()) {
+    if(m_list || m_lwait || !newgrp.empty() || m_list_devices || m_per_window || m_convert) {
       CHECK_MSG(verbose, m_cnt==1, "Invalid flag combination. Try --help.");
     }
+    if(m_all_devices) {
+      CHECK_MSG(verbose, m_lwait && m_device.empty(), "Invalid flag combination. Try --help.");
+    }
+    if(!m_rules.empty()) {
+      CHECK_MSG(verbose, m_per_window, "Invalid flag combination. Try --help.");
+    }
+    if(m_load) {
+      CHECK_MSG(verbose, !newgrp.empty(), "Invalid flag combination. Try --help.");
+    }
+    if(!m_record.empty()) {
+      CHECK_MSG(verbose, m_lwait && m_device.empty() && !m_all_devices &&
+          m_displays.empty(),
+          "Invalid flag combination. Try --help.");
+    }
+    if(m_publish_shm) {
+      CHECK_MSG(verbose, (m_cnt==0 || m_lwait) && m_device.empty() && !m_all_devices &&
+          m_displays.empty() && m_record.empty() && !m_daemon && !m_batch && !m_read_shm,
+          "Invalid flag combination. Try --help.");
+    }
+    if(m_read_shm) {
+      CHECK_MSG(verbose, m_cnt == m_list + m_wait + m_print && !(m_list && m_fancy) &&
+          m_device.empty() && !m_daemon && !m_batch,
+          "Invalid flag combination. Try --help.");
+      StatusReader reader;
+      shm_status status;
+      CHECK_MSG(verbose, reader.open(status_file_path(verbose)) && reader.read(status),
+          "No xkb-switch --publish-shm is running for this display");
+      if(m_wait) {
+        int ret = reader.wait(status.generation, m_timeout);
+        CHECK_MSG(verbose, ret >= 0, "The status publisher has exited");
+        if(ret == 0) {
+          MSG(verbose, "Timeout expired");
+          return 1;
+        }
+        CHECK_MSG(verbose, reader.read(status), "The status publisher has exited");
+      }
+      if(m_list) {
+        istringstream iss(status.layouts);
+        string name;
+        while(iss >> name) {
+          cout << name << endl;
+        }
+      }
+      else {
+        cout << (m_fancy ? status.fancy : status.name) << endl;
+      }
+      return 0;
+    }
+    if(!m_displays.empty()) {
+      CHECK_MSG(verbose, m_lwait && m_device.empty() && !m_all_devices,
+          "Invalid flag combination. Try --help.");
+      Writer out(STDOUT_FILENO, m_flush, verbose);
+      run_monitor(parse_display_list(m_displays), m_format, m_fancy, out, verbose);
+      return 0;
+    }
+
+    if(m_batch) {
+      CHECK_MSG(verbose, m_cnt==0 && !m_daemon, "Invalid flag combination. Try --help.");
+      XKeyboard xkb(verbose);
+      stats_guard stats(xkb, m_stats);
+      xkb.open_display();
+      if(!m_device.empty())
+        xkb.set_device(find_keyboard(xkb, m_device));
+      run_batch(xkb, STDIN_FILENO, STDOUT_FILENO);
+      return 0;
+    }
+
+    if(m_daemon) {
+      CHECK_MSG(verbose, m_cnt==0, "Invalid flag combination. Try --help.");
+      XKeyboard xkb(verbose);
+      stats_guard stats(xkb, m_stats);
+      xkb.open_display();
+      if(!m_device.empty())
+        xkb.set_device(find_keyboard(xkb, m_device));
+      run_daemon(xkb, daemon_socket_path(verbose));
+      return 0;
+    }
+
+    if(m_publish_shm && !m_lwait) {
+      XKeyboard xkb(verbose);
+      stats_guard stats(xkb, m_stats);
+      xkb.open_display();
+      StatusPublisher publisher(status_file_path(verbose), verbose);
+      publish_groups(xkb, publisher);
+      return 0;
+    }
 
     // Default action
     if(m_cnt==0)
       m_print = 1;
 
+    // Let the running daemon do the job, if any. It serves the core keyboard.
+    if(!m_wait && !m_lwait && !m_list_devices && !m_per_window && !m_toggle &&
+       !m_mru && !m_convert && m_device.empty()) {
+      DaemonClient client(verbose);
+      if(client.connect(daemon_socket_path(verbose))) {
+        if(m_stats) {
+          cerr << "served by daemon, no X requests" << endl;
+        }
+        if(m_next) {
+          client.request("next");
+        }
+        else if(!newgrp.empty()) {
+          client.request((m_load ? "load " : "set ") + newgrp);
+        }
+        if(m_print) {
+          cout << client.request(m_fancy ? "fancy" : "get") << endl;
+        }
+        if(m_list && m_fancy) {
+          istringstream iss(client.request("names"));
+          string name;
+          while(getline(iss, name, '\t')) {
+            cout << name << endl;
+          }
+        }
+        else if(m_list) {
+          istringstream iss(client.request("list"));
+          string name;
+          while(iss >> name) {
+            cout << name << endl;
+          }
+        }
+        return 0;
+      }
+    }
+
     XKeyboard xkb(verbose);
+    stats_guard stats(xkb, m_stats);
     xkb.open_display();
 
+    if(m_list_devices) {
+      device_vector devices;
+      list_keyboards(xkb, devices);
+      for(size_t i=0; i<devices.size(); i++) {
+        cout << devices[i].id << "\t" << (devices[i].master ? "master" : "slave")
+             << "\t" << devices[i].name << endl;
+      }
+      return 0;
+    }
+
+    if(!m_device.empty()) {
+      xkb.set_device(find_keyboard(xkb, m_device));
+    }
+
+    if(m_convert) {
+      const LayoutTable& table = xkb.layout_table();
+      int from = table.lookup(m_convert_from);
+      int to = table.lookup(m_convert_to);
+      CHECK_MSG(verbose, from >= 0,
+        "Group '" << m_convert_from << "' is not supported by current layout. Try xkb-switch -l.");
+      CHECK_MSG(verbose, to >= 0,
+        "Group '" << m_convert_to << "' is not supported by current layout. Try xkb-switch -l.");
+      TextConverter converter;
+      converter.prepare(xkb, from, to);
+      convert_stream(converter, STDIN_FILENO, STDOUT_FILENO, verbose);
+      return 0;
+    }
+
+    if(m_per_window) {
+      run_per_window(xkb, PER_WINDOW_CAPACITY, m_rules);
+      return 0;
+    }
+
     if(m_wait) {
-      xkb.wait_event();
+      if(xkb.wait_event(m_timeout, EVENT_STATE) == EVENT_NONE) {
+        MSG(verbose, "Timeout expired");
+        return 1;
+      }
     }
 
     if(m_lwait) {
-      while(true) {
-        xkb.wait_event();
-        xkb.build_layout(syms);
-        syms_collected = true;
-        cout << get_layout_group_name(xkb, syms, m_fancy) << endl;
+      Writer out(STDOUT_FILENO, m_flush, verbose);
+      if(m_stats) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = on_stats_signal;
+        sigaction(SIGUSR1, &sa, NULL);
+      }
+      if(m_all_devices) {
+        device_vector devices;
+        list_keyboards(xkb, devices);
+        stream_devices(xkb, devices, m_format, m_fancy, out, print_requested_stats);
+      }
+      else if(!m_record.empty()) {
+        ofstream log(m_record.c_str());
+        CHECK_MSG(verbose, log, "Failed to open " << m_record);
+        record_groups(xkb, log, m_format, m_fancy, out, print_requested_stats);
+      }
+      else if(m_publish_shm) {
+        StatusPublisher publisher(status_file_path(verbose), verbose);
+        stream_groups(xkb, m_format, m_fancy, out, print_requested_stats, &publisher);
+      }
+      else {
+        stream_groups(xkb, m_format, m_fancy, out, print_requested_stats);
+      }
+    }
+
+    if(m_toggle || m_mru) {
+      CHECK_MSG(verbose, !m_next && newgrp.empty() && !m_list && !(m_toggle && m_mru),
+          "Invalid flag combination. Try --help.");
+      GroupHistory history(xkb);
+      int primary = -1;
+      if(!m_primary.empty()) {
+        primary = xkb.layout_table().lookup(m_primary);
+        CHECK_MSG(verbose, primary >= 0,
+          "Group '" << m_primary << "' is not supported by current layout. Try xkb-switch -l.");
       }
+      int timeout = m_timeout >= 0 ? m_timeout : SET_CONFIRM_TIMEOUT_MS;
+      group_change change = m_toggle ? history.toggle(primary, timeout)
+                                     : history.recent(m_mru, timeout);
+      if(verbose >= 2) {
+        cerr << "[DEBUG] group " << change.group << " at server time " << change.time
+             << (change.confirmed ? "" : " (not confirmed)") << endl;
+      }
+      if(change.group != history._target) {
+        cerr << "Group change was not confirmed by the X server" << endl;
+        return 1;
+      }
+      if(m_print) {
+        const char* name = m_fancy ? NULL : xkb.layout_table().name(change.group);
+        cout << (name ? string(name) : xkb.get_long_group_name()) << endl;
+      }
+      return 0;
     }
 
-    layout_variant_strings lv = xkb.get_layout_variant();
-    if(verbose >= 2) {
-      cerr << "[DEBUG] layout: " << (lv.first.length() > 0 ? lv.first : "<empty>") << endl;
-      cerr << "[DEBUG] variant: " << (lv.second.length() > 0 ? lv.second : "<empty>") << endl;
+    // Ask for everything this invocation needs at once, including the
+    // history a switch is recorded in. Fancy names don't need the rules
+    // property.
+    bool need_syms = m_next || !newgrp.empty() || !m_fancy;
+    xkb.prefetch((need_syms ? QUERY_RULES : 0) |
+                 (m_next || m_print || !newgrp.empty() ? QUERY_GROUP : 0) |
+                 (m_next || !newgrp.empty() ? QUERY_HISTORY : 0) |
+                 (m_fancy && (m_print || m_list) ? QUERY_NAMES : 0));
+
+    if(need_syms) {
+      layout_variant_strings lv = xkb.get_layout_variant();
+      if(verbose >= 2) {
+        cerr << "[DEBUG] layout: " << (lv.first.length() > 0 ? lv.first : "<empty>") << endl;
+        cerr << "[DEBUG] variant: " << (lv.second.length() > 0 ? lv.second : "<empty>") << endl;
+      }
+      table = LayoutTable(lv);
+      syms = table.to_vector();
+      syms_collected = true;
     }
-    xkb.build_layout_from(syms, lv);
-    syms_collected = true;
 
+    int target = -1;
     if (m_next) {
-      CHECK_MSG(verbose, !syms.empty(), "No layout groups configured");
-      const string nextgrp = syms.at(xkb.get_group());
-      string_vector::iterator i = find(syms.begin(), syms.end(), nextgrp);
-      if (++i == syms.end())i = syms.begin();
-      xkb.set_group(i - syms.begin());
+      CHECK_MSG(verbose, !table.empty(), "No layout groups configured");
+      const char* nextgrp = table.name(xkb.get_group());
+      CHECK_MSG(verbose, nextgrp != NULL, "Group " << xkb.get_group() << " is out of range");
+      target = (table.find(nextgrp) + 1) % table.size();
     }
     else if(!newgrp.empty()) {
-      string_vector::iterator i = find(syms.begin(), syms.end(), newgrp);
-      CHECK_MSG(verbose, i!=syms.end(),
+      target = table.lookup(newgrp);
+      if(target < 0 && m_load) {
+        // Not among the loaded groups, rebuild the keymap with it
+        target = KeymapStore(xkb).load(newgrp);
+        table = xkb.layout_table();
+        syms = table.to_vector();
+      }
+      CHECK_MSG(verbose, target >= 0,
         "Group '" << newgrp << "' is not supported by current layout. Try xkb-switch -l.");
-      xkb.set_group(i-syms.begin());
+    }
+
+    // Wait until the server reports the switch, so that the callers don't
+    // race against it. Locking the current group would report nothing.
+    if(target >= 0 && target != xkb.get_group()) {
+      group_change change = xkb.set_group_confirm(target,
+          m_timeout >= 0 ? m_timeout : SET_CONFIRM_TIMEOUT_MS);
+      if(verbose >= 2) {
+        cerr << "[DEBUG] group " << change.group << " at server time " << change.time
+             << (change.confirmed ? "" : " (not confirmed)") << endl;
+      }
+      if(change.group != target) {
+        cerr << "Group change was not confirmed by the X server" << endl;
+        return 1;
+      }
     }
 
     if(m_print) {
@@ -211,8 +657,9 @@ int main( int argc, char* argv[] )
     }
 
     if(m_list) {
-      for(int i=0; i<syms.size(); i++) {
-        cout << syms[i] << endl;
+      const string_vector& names = m_fancy ? xkb.group_names() : syms;
+      for(size_t i=0; i<names.size(); i++) {
+        cout << names[i] << endl;
       }
     }
     return 0;
@@ -22,9 +22,33 @@
  * SOFTWARE.
  */
 
-/** XKb Switch API for using in vim libcall() */
+/** XKb Switch API for using in vim libcall()
+ *
+ * The current layout is tracked by a background thread which owns a separate
+ * display connection, listens for XKB state and names events and publishes an
+ * immutable snapshot through an atomic pointer. The getter reads the snapshot
+ * and never touches the X socket. Note, that libX11 >= 1.8 initializes its
+ * thread support automatically, older versions require the host program to
+ * call XInitThreads().
+ *
+ * Editors may poll the descriptor returned by Xkb_Switch_getEventFd() instead
+ * of the getter. The watcher writes to it whenever it publishes a new
+ * snapshot and Xkb_Switch_readEvents() drains it.
+ */
 
 #include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+
 #include "XKeyboard.hpp"
 
 using namespace std;
@@ -65,32 +89,309 @@ namespace
                 return xkb;
             }
 
+            /* Returns the keyboard without opening it */
+            const XKeyboard *  peek( void ) const
+            {
+                return xkb;
+            }
+
         private:
             XKeyboard *  xkb;
             bool         unusable;
 
     }  xkb;
 
-    string_vector  symNames;
 
-    string_vector &  getSymNames( void )
+    struct  Layouts;
+
+    /* Immutable state published by the watcher */
+    struct  Snapshot
     {
-        static bool  loaded = false;
+        int              group;
+        const Layouts *  layouts;
+    };
+
+    /* Layout names together with one snapshot per possible group, so that
+     * a group change never allocates. Replaced layouts are freed once no
+     * reader holds a Watcher::Reader. */
+    struct  Layouts
+    {
+        LayoutTable  table;
+        Snapshot     snapshots[ XkbNumKbdGroups ];
+    };
 
-        if ( loaded )
-            return symNames;
 
-        XKeyboard *  xkb = ::xkb.get();
+    class  Watcher
+    {
+        public:
+            /* Keeps the published layouts alive while in scope */
+            class  Reader
+            {
+                public:
+                    explicit Reader( Watcher &  w ) : watcher( w )
+                    {
+                        watcher.readers.fetch_add( 1, memory_order_seq_cst );
+                    }
+
+                    ~Reader()
+                    {
+                        watcher.readers.fetch_sub( 1, memory_order_seq_cst );
+                    }
+
+                private:
+                    Watcher &  watcher;
+            };
+
+            Watcher() : current( NULL ), notified( false ), readers( 0 ), xkb( 0 )
+            {
+                wakeup[ 0 ] = wakeup[ 1 ] = -1;
+                notify[ 0 ] = notify[ 1 ] = -1;
+                memset( &stats, 0, sizeof( stats ) );
+            }
 
-        if ( ! xkb )
-        {
-            loaded = true;
-            return symNames;
-        }
+            ~Watcher()
+            {
+                if ( thread.joinable() )
+                {
+                    char  c = 0;
+
+                    if ( write( wakeup[ 1 ], &c, 1 ) != 1 )
+                    {
+                        /* Can't stop the thread, leave it its data */
+                        thread.detach();
+                        return;
+                    }
+
+                    thread.join();
+                }
+
+                if ( wakeup[ 0 ] >= 0 )
+                {
+                    close( wakeup[ 0 ] );
+                    close( wakeup[ 1 ] );
+                }
+
+                if ( notify[ 0 ] >= 0 )
+                {
+                    close( notify[ 0 ] );
+                    close( notify[ 1 ] );
+                }
+
+                for ( list< Layouts * >::iterator  i = tables.begin();
+                      i != tables.end(); ++i )
+                    delete *i;
+            }
+
+            /* Returns a copy of the watcher's X request statistics */
+            xstats  getStats( void )
+            {
+                lock_guard< mutex >  lock( statsLock );
+                return stats;
+            }
 
-        loaded = true;
-        xkb->build_layout(symNames);
-        return symNames;
+            /* Returns the latest snapshot or NULL if X is not available.
+             * The caller must hold a Reader. */
+            const Snapshot *  get( void )
+            {
+                /* Ordered after the Reader, see publish() */
+                const Snapshot *  s = current.load( memory_order_seq_cst );
+
+                if ( s )
+                    return s;
+
+                std::call_once( once, &Watcher::start, this );
+                return current.load( memory_order_seq_cst );
+            }
+
+            /* Returns the descriptor readable after snapshot changes or -1 */
+            int  eventFd( void )
+            {
+                return get() ? notify[ 0 ] : -1;
+            }
+
+            /* Drains the event descriptor and returns the latest snapshot.
+             * The flag is cleared before the snapshot is read, so a change
+             * published meanwhile is either returned or notified again.
+             * The caller must hold a Reader. */
+            const Snapshot *  drain( void )
+            {
+                if ( ! get() )
+                    return NULL;
+
+                char  buf[ 64 ];
+
+                while ( read( notify[ 0 ], buf, sizeof( buf ) ) > 0 )
+                    ;
+
+                notified.store( false, memory_order_seq_cst );
+                return current.load( memory_order_seq_cst );
+            }
+
+            /* Publishes a group locked by the setter before the watcher
+             * receives its event, unless a new snapshot replaced s */
+            void  publishGroup( const Snapshot *  s, int  group )
+            {
+                if ( group < 0 || group >= XkbNumKbdGroups )
+                    return;
+
+                if ( current.compare_exchange_strong( s,
+                            &s->layouts->snapshots[ group ],
+                            memory_order_acq_rel ) )
+                    signal();
+            }
+
+        private:
+            void  start( void )
+            {
+                if ( pipe2( wakeup, O_CLOEXEC ) != 0 )
+                {
+                    wakeup[ 0 ] = wakeup[ 1 ] = -1;
+                    return;
+                }
+
+                if ( pipe2( notify, O_CLOEXEC | O_NONBLOCK ) != 0 )
+                    notify[ 0 ] = notify[ 1 ] = -1;
+
+                try
+                {
+                    xkb.open_display();
+                    xkb.enable_cache();
+                    publish();
+                    thread = std::thread( &Watcher::run, this );
+                }
+                catch( ... )
+                {
+                }
+            }
+
+            void  run( void )
+            {
+                try
+                {
+                    while ( true )
+                    {
+                        xkb.process_events();
+                        publish();
+
+                        {
+                            lock_guard< mutex >  lock( statsLock );
+                            stats = xkb.stats();
+                        }
+
+                        pollfd  fds[ 2 ];
+                        fds[ 0 ].fd = ConnectionNumber( xkb._display );
+                        fds[ 0 ].events = POLLIN;
+                        fds[ 1 ].fd = wakeup[ 0 ];
+                        fds[ 1 ].events = POLLIN;
+
+                        if ( poll( fds, 2, -1 ) < 0 )
+                            continue;
+
+                        if ( fds[ 1 ].revents )
+                            break;
+                    }
+                }
+                catch( ... )
+                {
+                }
+            }
+
+            void  publish( void )
+            {
+                const Snapshot *  s = current.load( memory_order_relaxed );
+                const Layouts *   layouts = s ? s->layouts : NULL;
+
+                if ( ! layouts || ! xkb.layout_valid() )
+                {
+                    const LayoutTable &  table = xkb.layout_table();
+
+                    if ( ! layouts || layouts->table != table )
+                    {
+                        Layouts *  l = new Layouts;
+                        l->table = table;
+                        for ( int  i = 0; i < XkbNumKbdGroups; ++i )
+                        {
+                            l->snapshots[ i ].group = i;
+                            l->snapshots[ i ].layouts = l;
+                        }
+                        tables.push_back( l );
+                        layouts = l;
+                    }
+                }
+
+                int  group = xkb.get_group();
+
+                if ( group < 0 || group >= XkbNumKbdGroups )
+                    group = 0;
+
+                const Snapshot *  next = &layouts->snapshots[ group ];
+
+                if ( next != s )
+                {
+                    current.store( next, memory_order_seq_cst );
+                    signal();
+                }
+
+                /* A reader that comes after the store sees the new layouts */
+                if ( tables.size() > 1 &&
+                     readers.load( memory_order_seq_cst ) == 0 )
+                {
+                    for ( list< Layouts * >::iterator  i = tables.begin();
+                          i != tables.end(); )
+                    {
+                        if ( *i == layouts )
+                        {
+                            ++i;
+                            continue;
+                        }
+                        delete *i;
+                        i = tables.erase( i );
+                    }
+                }
+            }
+
+            /* Writes one byte until the reader drains the descriptor */
+            void  signal( void )
+            {
+                if ( notify[ 1 ] >= 0 &&
+                     ! notified.exchange( true, memory_order_seq_cst ) )
+                {
+                    char  c = 0;
+
+                    if ( write( notify[ 1 ], &c, 1 ) != 1 )
+                        notified.store( false, memory_order_relaxed );
+                }
+            }
+
+            atomic< const Snapshot * >  current;
+            atomic< bool >              notified;
+            atomic< int >               readers;
+            int                         notify[ 2 ];
+            XKeyboard                   xkb;
+            std::once_flag              once;
+            std::thread                 thread;
+            int                         wakeup[ 2 ];
+            list< Layouts * >           tables;
+            mutex                       statsLock;
+            xstats                      stats;
+
+    }  watcher;
+
+
+    /* Returns the name of the snapshot group or an empty string. The name
+     * is copied, so it stays valid after the layouts are freed, until the
+     * next call in the same thread. */
+    const char *  snapshotName( const Snapshot *  s )
+    {
+        static thread_local string  name;
+
+        if ( ! s )
+            return "";
+
+        const char *  n = s->layouts->table.name( s->group );
+
+        name = n ? n : "";
+        return name.c_str();
     }
 }
 
@@ -98,17 +399,35 @@ namespace
 extern "C"
 {
     const char *  Xkb_Switch_getXkbLayout( const char *  /* unused */ )
+    {
+        Watcher::Reader  reader( watcher );
+
+        return snapshotName( watcher.get() );
+    }
+
+
+    const char *  Xkb_Switch_setXkbLayout( const char *  newgrp )
     {
         try
         {
-            XKeyboard *  xkb = ::xkb.get();
+            Watcher::Reader   reader( watcher );
+            const Snapshot *  s = watcher.get();
+            XKeyboard *       xkb = ::xkb.get();
 
-            if ( ! xkb )
+            if ( ! s || ! xkb )
                 return "";
 
-            string_vector &  syms = getSymNames();
+            if ( newgrp == NULL || newgrp[ 0 ] == '\0' )
+                return NULL;
+
+            int  group = s->layouts->table.lookup( newgrp );
 
-            return syms.at( xkb->get_group() ).c_str();
+            if ( group < 0 )
+               return NULL;
+
+            /* A bare lock, Vim waits for the call */
+            xkb->lock_group( group );
+            watcher.publishGroup( s, group );
         }
         catch( ... )
         {
@@ -118,27 +437,45 @@ extern "C"
     }
 
 
-    const char *  Xkb_Switch_setXkbLayout( const char *  newgrp )
+    /* Returns a descriptor which becomes readable when the group or the
+     * layout list changes, -1 if X is not available. The descriptor belongs
+     * to the library and stays valid while it is loaded. */
+    int  Xkb_Switch_getEventFd( const char *  /* unused */ )
     {
-        try
-        {
-            XKeyboard *  xkb = ::xkb.get();
+        return watcher.eventFd();
+    }
 
-            if ( ! xkb )
-                return "";
 
-            string_vector &  syms = getSymNames();
+    /* Drains the descriptor of Xkb_Switch_getEventFd() and returns the
+     * current layout */
+    const char *  Xkb_Switch_readEvents( const char *  /* unused */ )
+    {
+        Watcher::Reader  reader( watcher );
 
-            if ( newgrp == NULL || newgrp[ 0 ] == '\0' )
-                return NULL;
+        return snapshotName( watcher.drain() );
+    }
 
-            string_vector::iterator  i = find( syms.begin(), syms.end(),
-                                               newgrp );
 
-            if ( i == syms.end() )
-               return NULL;
+    /* Returns X request statistics of the library connections as text */
+    const char *  Xkb_Switch_getStats( const char *  /* unused */ )
+    {
+        static string  text;
+
+        try
+        {
+            ostringstream  out;
+
+            out << "[watcher]" << endl;
+            print_stats( out, watcher.getStats() );
+
+            if ( ::xkb.peek() )
+            {
+                out << "[setter]" << endl;
+                print_stats( out, ::xkb.peek()->stats() );
+            }
 
-            xkb->set_group( i - syms.begin() );
+            text = out.str();
+            return text.c_str();
         }
         catch( ... )
         {
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Handle-based C API of libxkbswitch
+ *
+ * Every handle owns a display connection subscribed to XKB events, so that
+ * reading the group and the names takes no round trip to the server. Calls
+ * don't allocate memory except xkbswitch_open(), the rebuild of the name
+ * and conversion tables after the layouts change, and xkbswitch_set_group()
+ * reading the group history property once after the open and after other
+ * clients change it. No call grabs the server.
+ *
+ * Thread safety: calls on the same handle are serialized by a lock inside the
+ * handle, different handles may be used from different threads concurrently.
+ * libX11 older than 1.8 requires the host to call XInitThreads() before
+ * opening handles from several threads.
+ *
+ * Functions return a negative XKBSWITCH_E* code on errors. Groups are
+ * numbered from 0.
+ */
+
+#ifndef XKBSWITCHAPI_H
+#define XKBSWITCHAPI_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define XKBSWITCH_API_VERSION 2
+
+enum {
+  XKBSWITCH_OK = 0,
+  XKBSWITCH_EINVAL = -1,     /* Invalid argument, e.g. a NULL handle */
+  XKBSWITCH_EDISPLAY = -2,   /* Failed to open the display */
+  XKBSWITCH_ENOTFOUND = -3,  /* No group with this name */
+  XKBSWITCH_ERANGE = -4,     /* Group index out of range */
+  XKBSWITCH_EX11 = -5,       /* X request failed */
+  XKBSWITCH_ENOSTATUS = -6,  /* No xkb-switch --publish-shm is running */
+  XKBSWITCH_ETIMEDOUT = -7   /* The status didn't change in time */
+};
+
+typedef struct xkbswitch xkbswitch_t;
+
+/* Opens a handle for the display (the DISPLAY variable if NULL or empty) and
+ * stores it into *handle. Returns XKBSWITCH_OK or an error code. */
+int xkbswitch_open(const char* display, xkbswitch_t** handle);
+
+/* Closes the handle and its connection. NULL is ignored. */
+void xkbswitch_close(xkbswitch_t* handle);
+
+/* Returns the current group */
+int xkbswitch_get_group(xkbswitch_t* handle);
+
+/* Locks the group and queues the group history update after the lock.
+ * Returns XKBSWITCH_OK or an error code. */
+int xkbswitch_set_group(xkbswitch_t* handle, int group);
+
+/* Locks the group and returns the group that was current before, which
+ * toggle plugins pass back later */
+int xkbswitch_exchange_group(xkbswitch_t* handle, int group);
+
+/* Returns the number of groups */
+int xkbswitch_group_count(xkbswitch_t* handle);
+
+/* Returns the group with this name, as printed by xkb-switch -l, or the first
+ * group of a bare layout ("ru" matches "ru(phonetic)") */
+int xkbswitch_find_group(xkbswitch_t* handle, const char* name);
+
+/* Writes the NUL-terminated name of the group to buf, truncated to size
+ * bytes. Returns the length of the full name like snprintf(), so a result
+ * not less than size means the buffer was too small. */
+int xkbswitch_group_name(xkbswitch_t* handle, int group, char* buf, size_t size);
+
+/* Retypes UTF-8 text typed in group from as if it was typed in group to,
+ * mapping the characters of every key to those of the same key in the other
+ * group. out must hold 4 * len bytes; the output isn't NUL-terminated.
+ * Returns the output length or an error code. */
+int xkbswitch_convert(xkbswitch_t* handle, int from, int to, const char* in,
+                      size_t len, char* out, size_t size);
+
+/* State published by xkb-switch --publish-shm for $DISPLAY. Reading it takes
+ * no X connection and no handle. */
+typedef struct xkbswitch_status {
+  unsigned int generation;  /* Incremented on every change */
+  int group;
+  int count;                /* Number of groups */
+  char name[40];            /* Short name of the group */
+  char fancy[64];           /* Fancy name of the group */
+  char layouts[888];        /* Short names of all groups separated by spaces */
+} xkbswitch_status_t;
+
+/* Copies the published status. Returns XKBSWITCH_OK or an error code. */
+int xkbswitch_read_status(xkbswitch_status_t* status);
+
+/* Sleeps until the generation of the status differs from the given one, at
+ * most timeout_ms milliseconds (forever if negative). Returns XKBSWITCH_OK,
+ * XKBSWITCH_ETIMEDOUT or another error code. */
+int xkbswitch_wait_status(unsigned int generation, int timeout_ms);
+
+/* Returns a static description of the error code */
+const char* xkbswitch_strerror(int code);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,347 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Handle-based C API of libxkbswitch, see XKbSwitchApi.h */
+
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string>
+
+#include "XKbSwitchApi.h"
+#include "XKeyboard.hpp"
+#include "StatusShm.hpp"
+#include "TextConverter.hpp"
+
+using namespace std;
+using namespace kb;
+
+struct  xkbswitch
+{
+    xkbswitch() : xkb( 0 )
+    {}
+
+    mutex          lock;
+    XKeyboard      xkb;
+    TextConverter  converter;
+};
+
+
+static_assert( sizeof( xkbswitch_status_t::name ) == sizeof( shm_status::name ) &&
+               sizeof( xkbswitch_status_t::fancy ) == sizeof( shm_status::fancy ) &&
+               sizeof( xkbswitch_status_t::layouts ) == sizeof( shm_status::layouts ),
+               "xkbswitch_status_t must match the status file" );
+
+
+namespace
+{
+    /* Returns the group count of the current layout table */
+    int  groupCount( xkbswitch *  handle )
+    {
+        return handle->xkb.layout_table().size();
+    }
+
+    int  setGroup( xkbswitch *  handle, int  group )
+    {
+        if ( group < 0 || group >= groupCount( handle ) )
+            return XKBSWITCH_ERANGE;
+
+        handle->xkb.set_group( group );
+        return XKBSWITCH_OK;
+    }
+
+    /* Mapping of the status file shared by xkbswitch_read_status() calls */
+    mutex         statusLock;
+    StatusReader  statusReader;
+
+    /* Reads the status, mapping the file again if the publisher restarted */
+    bool  readStatus( StatusReader &  reader, shm_status &  status )
+    {
+        if ( reader.read( status ) )
+            return true;
+
+        return reader.open( status_file_path( 0 ) ) && reader.read( status );
+    }
+}
+
+
+extern "C"
+{
+    int  xkbswitch_open( const char *  display, xkbswitch_t **  handle )
+    {
+        if ( handle == NULL )
+            return XKBSWITCH_EINVAL;
+
+        *handle = NULL;
+
+        xkbswitch *  h = new ( nothrow ) xkbswitch;
+
+        if ( h == NULL )
+            return XKBSWITCH_EDISPLAY;
+
+        try
+        {
+            h->xkb.open_display( display ? display : "" );
+            h->xkb.enable_cache();
+        }
+        catch( ... )
+        {
+            delete h;
+            return XKBSWITCH_EDISPLAY;
+        }
+
+        *handle = h;
+        return XKBSWITCH_OK;
+    }
+
+
+    void  xkbswitch_close( xkbswitch_t *  handle )
+    {
+        delete handle;
+    }
+
+
+    int  xkbswitch_get_group( xkbswitch_t *  handle )
+    {
+        if ( handle == NULL )
+            return XKBSWITCH_EINVAL;
+
+        lock_guard< mutex >  lock( handle->lock );
+
+        try
+        {
+            return handle->xkb.get_group();
+        }
+        catch( ... )
+        {
+        }
+
+        return XKBSWITCH_EX11;
+    }
+
+
+    int  xkbswitch_set_group( xkbswitch_t *  handle, int  group )
+    {
+        if ( handle == NULL )
+            return XKBSWITCH_EINVAL;
+
+        lock_guard< mutex >  lock( handle->lock );
+
+        try
+        {
+            return setGroup( handle, group );
+        }
+        catch( ... )
+        {
+        }
+
+        return XKBSWITCH_EX11;
+    }
+
+
+    int  xkbswitch_exchange_group( xkbswitch_t *  handle, int  group )
+    {
+        if ( handle == NULL )
+            return XKBSWITCH_EINVAL;
+
+        lock_guard< mutex >  lock( handle->lock );
+
+        try
+        {
+            int  previous = handle->xkb.get_group();
+            int  ret = setGroup( handle, group );
+
+            return ret == XKBSWITCH_OK ? previous : ret;
+        }
+        catch( ... )
+        {
+        }
+
+        return XKBSWITCH_EX11;
+    }
+
+
+    int  xkbswitch_group_count( xkbswitch_t *  handle )
+    {
+        if ( handle == NULL )
+            return XKBSWITCH_EINVAL;
+
+        lock_guard< mutex >  lock( handle->lock );
+
+        try
+        {
+            return groupCount( handle );
+        }
+        catch( ... )
+        {
+        }
+
+        return XKBSWITCH_EX11;
+    }
+
+
+    int  xkbswitch_find_group( xkbswitch_t *  handle, const char *  name )
+    {
+        if ( handle == NULL || name == NULL )
+            return XKBSWITCH_EINVAL;
+
+        lock_guard< mutex >  lock( handle->lock );
+
+        try
+        {
+            int  group = handle->xkb.layout_table().lookup( name );
+
+            return group >= 0 ? group : XKBSWITCH_ENOTFOUND;
+        }
+        catch( ... )
+        {
+        }
+
+        return XKBSWITCH_EX11;
+    }
+
+
+    int  xkbswitch_group_name( xkbswitch_t *  handle, int  group, char *  buf,
+                               size_t  size )
+    {
+        if ( handle == NULL || ( buf == NULL && size > 0 ) )
+            return XKBSWITCH_EINVAL;
+
+        lock_guard< mutex >  lock( handle->lock );
+
+        try
+        {
+            const LayoutTable &  table = handle->xkb.layout_table();
+            const char *         name = table.name( group );
+
+            if ( name == NULL )
+                return XKBSWITCH_ERANGE;
+
+            size_t  length = strlen( name );
+
+            if ( size > 0 )
+            {
+                size_t  n = length < size ? length : size - 1;
+
+                memcpy( buf, name, n );
+                buf[ n ] = '\0';
+            }
+
+            return static_cast< int >( length );
+        }
+        catch( ... )
+        {
+        }
+
+        return XKBSWITCH_EX11;
+    }
+
+
+    int  xkbswitch_convert( xkbswitch_t *  handle, int  from, int  to,
+                            const char *  in, size_t  len, char *  out,
+                            size_t  size )
+    {
+        if ( handle == NULL || ( in == NULL && len > 0 ) || out == NULL ||
+             size / 4 < len )
+            return XKBSWITCH_EINVAL;
+
+        lock_guard< mutex >  lock( handle->lock );
+
+        try
+        {
+            int  count = groupCount( handle );
+
+            if ( from < 0 || from >= count || to < 0 || to >= count )
+                return XKBSWITCH_ERANGE;
+
+            /* The tables are only rebuilt after the keymap changes */
+            handle->converter.prepare( handle->xkb, from, to );
+
+            return static_cast< int >(
+                    handle->converter.convert( in, len, out, NULL ) );
+        }
+        catch( ... )
+        {
+        }
+
+        return XKBSWITCH_EX11;
+    }
+
+
+    int  xkbswitch_read_status( xkbswitch_status_t *  status )
+    {
+        if ( status == NULL )
+            return XKBSWITCH_EINVAL;
+
+        lock_guard< mutex >  lock( statusLock );
+        shm_status           shm;
+
+        if ( ! readStatus( statusReader, shm ) )
+            return XKBSWITCH_ENOSTATUS;
+
+        status->generation = shm.generation;
+        status->group = shm.group;
+        status->count = shm.count;
+        memcpy( status->name, shm.name, sizeof( status->name ) );
+        memcpy( status->fancy, shm.fancy, sizeof( status->fancy ) );
+        memcpy( status->layouts, shm.layouts, sizeof( status->layouts ) );
+
+        return XKBSWITCH_OK;
+    }
+
+
+    int  xkbswitch_wait_status( unsigned int  generation, int  timeout_ms )
+    {
+        /* A private mapping, the shared one must not be locked while
+         * sleeping */
+        StatusReader  reader;
+        shm_status    shm;
+
+        if ( ! readStatus( reader, shm ) )
+            return XKBSWITCH_ENOSTATUS;
+
+        int  ret = reader.wait( generation, timeout_ms );
+
+        if ( ret < 0 )
+            return XKBSWITCH_ENOSTATUS;
+
+        return ret > 0 ? XKBSWITCH_OK : XKBSWITCH_ETIMEDOUT;
+    }
+
+
+    const char *  xkbswitch_strerror( int  code )
+    {
+        switch ( code )
+        {
+            case XKBSWITCH_OK:          return "Success";
+            case XKBSWITCH_EINVAL:      return "Invalid argument";
+            case XKBSWITCH_EDISPLAY:    return "Failed to open the display";
+            case XKBSWITCH_ENOTFOUND:   return "No such layout group";
+            case XKBSWITCH_ERANGE:      return "Group index out of range";
+            case XKBSWITCH_EX11:        return "X request failed";
+            case XKBSWITCH_ENOSTATUS:   return "No status publisher is running";
+            case XKBSWITCH_ETIMEDOUT:   return "Status didn't change in time";
+            default:                    return "Unknown error";
+        }
+    }
+}
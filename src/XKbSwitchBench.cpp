@@ -0,0 +1,478 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Latency benchmark of XKeyboard operations against a private Xvfb server */
+
+#include <X11/XKBlib.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "XKeyboard.hpp"
+#include "TextConverter.hpp"
+#include "FakeBackend.hpp"
+#include "Utils.hpp"
+
+using namespace std;
+using namespace kb;
+
+void usage()
+{
+  cerr << "Usage: xkb-switch-bench [-n N] [-o FILE] [--layouts L] [--display D]" << endl;
+  cerr << "  -n|--iterations N  Number of iterations per operation (default 1000)" << endl;
+  cerr << "  -o|--output FILE   Write the results as JSON to FILE" << endl;
+  cerr << "  --layouts L        Layouts to load into the keymap (default us,ru,de)" << endl;
+  cerr << "  --display D        Use the running X server D instead of starting Xvfb" << endl;
+  cerr << "  --xvfb PATH        Xvfb executable (default Xvfb)" << endl;
+  cerr << "  --program PATH     xkb-switch executable to start (default: next to" << endl;
+  cerr << "                     the benchmark)" << endl;
+  cerr << "  --replay FILE      Only measure the replay of events recorded with" << endl;
+  cerr << "                     xkb-switch -W --record, needs no X server" << endl;
+  cerr << "  -d|--debug         Print debug information" << endl;
+  cerr << "  -h|--help          Displays this message" << endl;
+}
+
+// Long-only options
+enum {
+  OPT_LAYOUTS = 256,
+  OPT_DISPLAY,
+  OPT_XVFB,
+  OPT_PROGRAM,
+  OPT_REPLAY,
+};
+
+struct result {
+  string name;
+  size_t count;
+  double p50;    // Microseconds
+  double p99;
+  double mean;
+  double ops;    // Operations per second
+};
+
+double now_us()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+template<class F>
+result measure(const string& name, size_t count, F f)
+{
+  vector<double> samples(count);
+  double start = now_us();
+  for(size_t i=0; i<count; i++) {
+    double t = now_us();
+    f(i);
+    samples[i] = now_us() - t;
+  }
+  double total = now_us() - start;
+
+  result r;
+  r.name = name;
+  r.count = count;
+  r.mean = 0;
+  for(size_t i=0; i<count; i++)
+    r.mean += samples[i];
+  r.mean /= count;
+  sort(samples.begin(), samples.end());
+  r.p50 = samples[count / 2];
+  r.p99 = samples[min(count - 1, count * 99 / 100)];
+  r.ops = total > 0 ? count * 1e6 / total : 0;
+  return r;
+}
+
+// Runs a program and waits for it (or throw std::runtime_error). Quiet
+// programs get /dev/null as stdout.
+void run(size_t verbose, const vector<string>& args, bool quiet = false)
+{
+  pid_t pid = fork();
+  CHECK_MSG(verbose, pid >= 0, "fork() failed: " << strerror(errno));
+  if(pid == 0) {
+    if(quiet) {
+      int fd = open("/dev/null", O_WRONLY);
+      if(fd >= 0)
+        dup2(fd, STDOUT_FILENO);
+    }
+    vector<char*> argv;
+    for(size_t i=0; i<args.size(); i++)
+      argv.push_back(const_cast<char*>(args[i].c_str()));
+    argv.push_back(NULL);
+    execvp(argv[0], &argv[0]);
+    _exit(127);
+  }
+  int status;
+  CHECK(verbose, waitpid(pid, &status, 0) == pid);
+  CHECK_MSG(verbose, WIFEXITED(status) && WEXITSTATUS(status) == 0,
+    args[0] << " failed with status " << status);
+}
+
+// Private X server, terminated with the object
+class Xvfb
+{
+public:
+
+  pid_t _pid;
+  string _display;
+  size_t _verbose;
+
+  Xvfb(size_t verbose) : _pid(-1), _verbose(verbose) {}
+
+  ~Xvfb()
+  {
+    if(_pid > 0) {
+      kill(_pid, SIGTERM);
+      waitpid(_pid, NULL, 0);
+    }
+  }
+
+  // Starts the server and waits until it accepts connections
+  void start(const string& program)
+  {
+    int fds[2];
+    CHECK(_verbose, pipe(fds) == 0);
+
+    _pid = fork();
+    CHECK_MSG(_verbose, _pid >= 0, "fork() failed: " << strerror(errno));
+    if(_pid == 0) {
+      close(fds[0]);
+      ostringstream fd;
+      fd << fds[1];
+      execlp(program.c_str(), program.c_str(), "-displayfd", fd.str().c_str(),
+             "-nolisten", "tcp", "-screen", "0", "640x480x24", (char*)NULL);
+      _exit(127);
+    }
+    close(fds[1]);
+
+    // Xvfb writes the display number once it is ready
+    string number;
+    pollfd pfd;
+    pfd.fd = fds[0];
+    pfd.events = POLLIN;
+    while(number.find('\n') == string::npos) {
+      int iret = poll(&pfd, 1, 10000);
+      CHECK_MSG(_verbose, iret > 0, "Timeout waiting for " << program);
+      char buf[16];
+      ssize_t n = read(fds[0], buf, sizeof(buf));
+      CHECK_MSG(_verbose, n > 0, "Failed to start " << program);
+      number.append(buf, n);
+    }
+    close(fds[0]);
+
+    _display = ":" + number.substr(0, number.find('\n'));
+    MSG(_verbose, "Started " << program << " on " << _display);
+  }
+};
+
+void print_results(const vector<result>& results)
+{
+  cout << left << setw(24) << "operation" << right
+       << setw(10) << "count"
+       << setw(12) << "p50,us"
+       << setw(12) << "p99,us"
+       << setw(12) << "mean,us"
+       << setw(12) << "ops/s" << endl;
+  for(size_t i=0; i<results.size(); i++) {
+    const result& r = results[i];
+    cout << left << setw(24) << r.name << right << fixed << setprecision(1)
+         << setw(10) << r.count
+         << setw(12) << r.p50
+         << setw(12) << r.p99
+         << setw(12) << r.mean
+         << setw(12) << r.ops << endl;
+  }
+}
+
+void write_json(const string& path, size_t iterations, const string& layouts,
+                const vector<result>& results, size_t verbose)
+{
+  ofstream out(path.c_str());
+  CHECK_MSG(verbose, out, "Failed to open " << path);
+  out << "{\n";
+  out << "  \"version\": \"" << XKBSWITCH_VERSION << "\",\n";
+  out << "  \"iterations\": " << iterations << ",\n";
+  out << "  \"layouts\": \"" << layouts << "\",\n";
+  out << "  \"results\": [\n";
+  for(size_t i=0; i<results.size(); i++) {
+    const result& r = results[i];
+    out << fixed << setprecision(3)
+        << "    {\"name\": \"" << r.name << "\", \"count\": " << r.count
+        << ", \"p50_us\": " << r.p50 << ", \"p99_us\": " << r.p99
+        << ", \"mean_us\": " << r.mean << ", \"ops_per_sec\": " << r.ops << "}"
+        << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  out << "  ]\n";
+  out << "}\n";
+  CHECK_MSG(verbose, out, "Failed to write " << path);
+}
+
+vector<result> run_benchmarks(size_t iterations, const string& program, size_t verbose)
+{
+  vector<result> results;
+
+  results.push_back(measure("open_display", iterations, [&](size_t) {
+    XKeyboard k(verbose);
+    k.open_display();
+  }));
+
+  XKeyboard xkb(verbose);
+  xkb.open_display();
+
+  string_vector syms;
+  xkb.build_layout(syms);
+  CHECK_MSG(verbose, syms.size() >= 2, "At least two layouts are required");
+  int groups = syms.size();
+
+  results.push_back(measure("get_group", iterations, [&](size_t) {
+    xkb.get_group();
+  }));
+
+  results.push_back(measure("set_group", iterations, [&](size_t i) {
+    xkb.set_group(i % groups);
+  }));
+  XSync(xkb._display, False);
+
+  results.push_back(measure("get_layout_variant", iterations, [&](size_t) {
+    xkb.get_layout_variant();
+  }));
+
+  layout_variant_strings lv = xkb.get_layout_variant();
+  results.push_back(measure("build_layout_from", iterations, [&](size_t) {
+    xkb.build_layout_from(syms, lv);
+  }));
+
+  results.push_back(measure("layout_table", iterations, [&](size_t) {
+    LayoutTable table(lv);
+  }));
+
+  LayoutTable table(lv);
+  results.push_back(measure("layout_lookup", iterations, [&](size_t i) {
+    table.lookup(syms[i % groups]);
+  }));
+
+  results.push_back(measure("get_long_group_name", iterations, [&](size_t) {
+    xkb.get_long_group_name();
+  }));
+
+  // Retyping of a megabyte of text, at the rate of clipboards and log files
+  TextConverter converter;
+  converter.prepare(xkb, 0, 1);
+  string text;
+  while(text.size() < (1 << 20))
+    text += "The quick brown fox jumps over the lazy dog. ";
+  vector<char> converted(4 * text.size());
+  results.push_back(measure("convert_1mb", iterations, [&](size_t) {
+    converter.convert(text.data(), text.size(), &converted[0], NULL);
+  }));
+
+  // Lock a different group every time and wait for the server to report it
+  xkb.select_events();
+  xkb.set_group(0);
+  XSync(xkb._display, False);
+  xkb.process_events();
+  results.push_back(measure("set_observe", iterations, [&](size_t i) {
+    xkb.set_group((i + 1) % groups);
+    CHECK_MSG(verbose, xkb.wait_event(1000, EVENT_STATE) != EVENT_NONE,
+      "No state event received");
+  }));
+
+  results.push_back(measure("set_confirm", iterations, [&](size_t i) {
+    // Continue the sequence of set_observe, so that every lock changes the group
+    group_change change = xkb.set_group_confirm((iterations + 1 + i) % groups, 1000);
+    CHECK_MSG(verbose, change.confirmed, "Group change not confirmed");
+  }));
+
+  // Time from exec to exit of the command line tool, which is what hotkeys
+  // and status bars see
+  vector<string> args;
+  args.push_back(program);
+  args.push_back("-p");
+  results.push_back(measure("exec_print", iterations, [&](size_t) {
+    run(verbose, args, true);
+  }));
+
+  args[1] = "-s";
+  args.push_back("");
+  results.push_back(measure("exec_set", iterations, [&](size_t i) {
+    args[2] = syms[i % groups];
+    run(verbose, args, true);
+  }));
+
+  return results;
+}
+
+// Streams the recorded events in every format, the results are per event
+vector<result> run_replay(const string& path, size_t iterations, size_t verbose)
+{
+  ifstream in(path.c_str());
+  CHECK_MSG(verbose, in, "Failed to open " << path);
+  event_log log;
+  read_event_log(in, log, verbose);
+  CHECK_MSG(verbose, log.size() > 1, "No events in " << path);
+  size_t events = log.size() - 1;
+
+  int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  CHECK_MSG(verbose, fd >= 0, "Failed to open /dev/null");
+
+  const char* names[] = {"replay_text", "replay_jsonl", "replay_binary"};
+  stream_format formats[] = {FORMAT_TEXT, FORMAT_JSONL, FORMAT_BINARY};
+  vector<result> results;
+  for(size_t f=0; f<3; f++) {
+    Writer out(fd, 0, verbose);
+    result r = measure(names[f], iterations, [&](size_t) {
+      replay_events(log, formats[f], 0, out, verbose);
+    });
+    r.count *= events;
+    r.p50 /= events;
+    r.p99 /= events;
+    r.mean /= events;
+    r.ops *= events;
+    results.push_back(r);
+  }
+  close(fd);
+  return results;
+}
+
+int main(int argc, char* argv[])
+{
+  size_t verbose = 1;
+
+  try {
+    size_t iterations = 1000;
+    string output;
+    string layouts = "us,ru,de";
+    string display;
+    string xvfb = "Xvfb";
+    string program;
+    string replay;
+    int opt;
+    int option_index = 0;
+
+    static struct option long_options[] = {
+            {"iterations", required_argument, NULL, 'n'},
+            {"output", required_argument, NULL, 'o'},
+            {"layouts", required_argument, NULL, OPT_LAYOUTS},
+            {"display", required_argument, NULL, OPT_DISPLAY},
+            {"xvfb", required_argument, NULL, OPT_XVFB},
+            {"program", required_argument, NULL, OPT_PROGRAM},
+            {"replay", required_argument, NULL, OPT_REPLAY},
+            {"debug", no_argument, NULL, 'd'},
+            {"help", no_argument, NULL, 'h'},
+            {NULL, 0, NULL, 0},
+    };
+    while ((opt = getopt_long(argc, argv, "n:o:dh",
+                              long_options, &option_index))!=-1) {
+      switch (opt) {
+      case 'n':
+        iterations = atoi(optarg);
+        CHECK_MSG(verbose, iterations > 0, "Invalid number of iterations");
+        break;
+      case 'o':
+        output = optarg;
+        break;
+      case OPT_LAYOUTS:
+        layouts = optarg;
+        break;
+      case OPT_DISPLAY:
+        display = optarg;
+        break;
+      case OPT_XVFB:
+        xvfb = optarg;
+        break;
+      case OPT_PROGRAM:
+        program = optarg;
+        break;
+      case OPT_REPLAY:
+        replay = optarg;
+        break;
+      case 'd':
+        verbose++;
+        break;
+      case 'h':
+        usage();
+        return 0;
+      default:
+        THROW_MSG(verbose, "Invalid arguments. Check --help.");
+      }
+    }
+
+    if(!replay.empty()) {
+      vector<result> results = run_replay(replay, iterations, verbose);
+      print_results(results);
+      if(!output.empty()) {
+        write_json(output, iterations, "", results, verbose);
+      }
+      return 0;
+    }
+
+    if(program.empty()) {
+      string self(argv[0]);
+      size_t slash = self.rfind('/');
+      program = (slash == string::npos ? string(".") : self.substr(0, slash)) + "/xkb-switch";
+    }
+
+    Xvfb server(verbose);
+    if(display.empty()) {
+      server.start(xvfb);
+      display = server._display;
+    }
+    setenv("DISPLAY", display.c_str(), 1);
+
+    vector<string> args;
+    args.push_back("setxkbmap");
+    args.push_back("-display");
+    args.push_back(display);
+    args.push_back("-layout");
+    args.push_back(layouts);
+    run(verbose, args);
+
+    vector<result> results = run_benchmarks(iterations, program, verbose);
+    print_results(results);
+    if(!output.empty()) {
+      write_json(output, iterations, layouts, results, verbose);
+    }
+    return 0;
+  }
+  catch(std::exception & err) {
+    cerr << "xkb-switch-bench: " << err.what() << endl;
+    return 2;
+  }
+}
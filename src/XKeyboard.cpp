@@ -28,32 +28,125 @@
 #include <cstdlib>
 #include <cctype>
 #include <cstring>
+#include <cerrno>
+#include <ctime>
 
 #include <iostream>
 #include <string>
 #include <sstream>
 
+#include <poll.h>
+
+#include <X11/Xatom.h>
 #include <X11/XKBlib.h>
-#include <X11/extensions/XKBrules.h>
 
 #include "XKeyboard.hpp"
+#include "XBackend.hpp"
 #include "Utils.hpp"
 
 using namespace std;
 
 namespace kb {
 
+static double now_us()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Accounts the wall time and the X requests of an XKeyboard method. Requests
+// of synchronous methods are counted as round trips too, other methods count
+// their round trips explicitly.
+struct stat_scope {
+  const XKeyboard& xkb;
+  method_stats& stats;
+  bool sync;
+  bool counted;
+  unsigned long first;
+  double start;
+
+  stat_scope(const XKeyboard& x, stat_method m, bool s)
+    : xkb(x), stats(x._stats.methods[m]), sync(s), counted(false),
+      first(x._display ? NextRequest(x._display) : 1), start(now_us()) {}
+
+  ~stat_scope() {
+    unsigned long requests = xkb._display ? NextRequest(xkb._display) - first : 0;
+    stats.calls++;
+    stats.time_us += now_us() - start;
+    if (counted)
+      return;
+    stats.requests += requests;
+    xkb._stats.requests += requests;
+    if (sync) {
+      stats.round_trips += requests;
+      xkb._stats.round_trips += requests;
+    }
+  }
+
+  void round_trip() {
+    stats.round_trips++;
+    xkb._stats.round_trips++;
+  }
+
+  // Takes the counters reported by a backend, which may bypass Xlib
+  void count(unsigned long requests, unsigned long round_trips) {
+    counted = true;
+    stats.requests += requests;
+    stats.round_trips += round_trips;
+    xkb._stats.requests += requests;
+    xkb._stats.round_trips += round_trips;
+  }
+};
+
+static const char* stat_names[STAT_METHODS] = {
+  "open_display",
+  "select_events",
+  "get_group",
+  "set_group",
+  "get_layout_variant",
+  "group_names",
+  "wait_event",
+  "query",
+  "keymap",
+};
+
+void print_stats(std::ostream& out, const xstats& stats)
+{
+  out << "total requests=" << stats.requests
+      << " round_trips=" << stats.round_trips
+      << " events=" << stats.events << std::endl;
+  for (int i = 0; i < STAT_METHODS; i++) {
+    const method_stats& m = stats.methods[i];
+    out << stat_names[i]
+        << " calls=" << m.calls
+        << " requests=" << m.requests
+        << " round_trips=" << m.round_trips
+        << " time_us=" << static_cast<unsigned long>(m.time_us) << std::endl;
+  }
+}
+
 XKeyboard::XKeyboard(size_t verbose)
-  : _display(0), _deviceId(XkbUseCoreKbd), _kbdDescPtr(0), _verbose(verbose)
+  : _display(0), _deviceId(XkbUseCoreKbd), _kbdDescPtr(0), _verbose(verbose),
+    _eventBase(0), _backend(0), _stateSelected(false), _selected(false),
+    _cached(false), _group(0), _eventTime(0), _eventSerial(0),
+    _layoutValid(false), _generation(0), _longNamesValid(false),
+    _keymapValid(false), _keymapGeneration(0), _lockSerial(0), _rulesAtom(None),
+    _historyAtom(None), _historyValid(false), _historyWrites(0), _eventDevice(0), _prefetched(0),
+    _observer(NULL), _observerArg(NULL)
 {
+  std::memset(&_stats, 0, sizeof(_stats));
+  _history.count = 0;
 }
 
-void XKeyboard::open_display()
+void XKeyboard::open_display(const std::string& name)
 {
+  stat_scope stat(*this, STAT_OPEN_DISPLAY, true);
 
   XkbIgnoreExtension(False);
 
-  char* displayName = strdup(""); // allocates memory for string!
+  _displayName = name;
+  char* displayName = strdup(name.c_str()); // allocates memory for string!
   int eventCode;
   int errorReturn;
   int major = XkbMajorVersion;
@@ -63,6 +156,7 @@ void XKeyboard::open_display()
   _display = XkbOpenDisplay(displayName, &eventCode, &errorReturn, &major,
       &minor, &reasonReturn);
   free(displayName);
+  _eventBase = eventCode;
   switch (reasonReturn) {
     case XkbOD_Success:           break;
     case XkbOD_BadLibraryVersion: THROW_MSG(_verbose, "Bad XKB library version.");
@@ -81,10 +175,29 @@ void XKeyboard::open_display()
   if (_deviceId != XkbUseCoreKbd) {
     _kbdDescPtr->device_spec = _deviceId;
   }
+
+#ifdef XKBSWITCH_XCB
+  _backend = make_xcb_backend(*this);
+#else
+  _backend = make_xlib_backend(*this);
+#endif
+}
+
+void XKeyboard::open_backend(XBackend* backend)
+{
+  CHECK(_verbose, _display == 0 && _backend == 0 && backend != 0);
+  _backend = backend;
+  // Any event code outside of the core protocol range
+  _eventBase = LASTEvent;
+  _group = get_group();
+  invalidate_names();
+  _cached = true;
 }
 
 XKeyboard::~XKeyboard()
 {
+  delete _backend;
+
   if(_kbdDescPtr!=NULL)
     XkbFreeKeyboard(_kbdDescPtr, 0, True);
 
@@ -93,179 +206,568 @@ XKeyboard::~XKeyboard()
   }
 }
 
-// XkbRF_VarDefsRec contains heap-allocated C strings, but doesn't provide a
-// direct cleanup method. This wrapper privides a workaround.
-// See also https://gitlab.freedesktop.org/xorg/lib/libxkbfile/issues/6
-struct XkbRF_VarDefsRec_wrapper {
+layout_variant_strings XKeyboard::get_layout_variant()
+{
+  if(_prefetched & QUERY_RULES) {
+    return _layoutVariant;
+  }
+  xkb_query q(QUERY_RULES);
+  run_query(q, STAT_GET_LAYOUT_VARIANT);
+  return q.lv;
+}
 
-  XkbRF_VarDefsRec _it;
+void XKeyboard::build_layout_from(string_vector& out, const layout_variant_strings& lv)
+{
+  MSG(_verbose, "layout \"" << lv.first << "\", variant \"" << lv.second << "\"");
+  out = LayoutTable(lv).to_vector();
+}
 
-  XkbRF_VarDefsRec_wrapper() {
-    std::memset(&_it,0,sizeof(_it));
-  }
 
-  ~XkbRF_VarDefsRec_wrapper() {
-    if(_it.model) std::free(_it.model);
-    if(_it.layout) std::free(_it.layout);
-    if(_it.variant) std::free(_it.variant);
-    if(_it.options) std::free(_it.options);
+void XKeyboard::build_layout(string_vector& out)
+{
+  out = layout();
+}
+
+const LayoutTable& XKeyboard::layout_table()
+{
+  if(_cached) {
+    process_events();
   }
-};
+  if(!_cached || !_layoutValid) {
+    layout_variant_strings lv=this->get_layout_variant();
+    MSG(_verbose, "layout \"" << lv.first << "\", variant \"" << lv.second << "\"");
+    _table = LayoutTable(lv);
+    _layout = _table.to_vector();
+    _layoutValid = true;
+  }
+  return _table;
+}
 
-struct XkbKeyboardWrapper {
-  XkbDescPtr ptr;
-  XkbKeyboardWrapper(XkbDescPtr p) : ptr(p) {}
-  ~XkbKeyboardWrapper() {
-    if (ptr) {
+const string_vector& XKeyboard::layout()
+{
+  layout_table();
+  return _layout;
+}
 
-      XkbFreeKeyboard(ptr, 0, True);
-    }
+void XKeyboard::set_device(int id)
+{
+  CHECK_MSG(_verbose, !_stateSelected && !_cached,
+      "The device can't be changed after subscribing to events");
+  _deviceId = id;
+  if (_kbdDescPtr != NULL) {
+    _kbdDescPtr->device_spec = id;
   }
-  // Disable copying
-  XkbKeyboardWrapper(const XkbKeyboardWrapper&) = delete;
-  XkbKeyboardWrapper& operator=(const XkbKeyboardWrapper&) = delete;
-};
+  _prefetched = 0;
+}
 
-struct XGetAtomNameWrapper {
-  Display* display;
-  char* ptr;
-  XGetAtomNameWrapper(Display* d, Atom atom) 
-    : display(d), ptr(XGetAtomName(d, atom)) {}
-  ~XGetAtomNameWrapper() {
-    if (ptr) {
-      XFree(ptr);
-    }
-  }
-};
+int XKeyboard::fd() const
+{
+  CHECK(_verbose, _display != 0);
+  return ConnectionNumber(_display);
+}
 
-layout_variant_strings XKeyboard::get_layout_variant()
+void XKeyboard::select_state_events()
 {
-  XkbRF_VarDefsRec_wrapper vdr;
-  char* tmp = NULL;
-  Bool bret;
+  CHECK(_verbose, _display != 0);
+  if(_stateSelected)
+    return;
 
-  bret = XkbRF_GetNamesProp(_display, &tmp, &vdr._it);
-  free(tmp);  // return memory allocated by XkbRF_GetNamesProp
-  CHECK_MSG(_verbose, bret==True, "Failed to get keyboard properties");
+  stat_scope stat(*this, STAT_SELECT_EVENTS, false);
+  Bool bret = XkbSelectEventDetails(_display, _deviceId,
+      XkbStateNotify, XkbAllStateComponentsMask, XkbGroupStateMask);
+  CHECK_MSG(_verbose, bret==True, "XkbSelectEventDetails failed");
+  _stateSelected = true;
+}
 
-  MSG(_verbose, "raw layout string \"" << vdr._it.layout << "\"");
-  if(vdr._it.variant)
-    MSG(_verbose, "raw variant string \"" << vdr._it.variant << "\"");
-  else
-    MSG(_verbose, "No raw variant string");
+void XKeyboard::select_events()
+{
+  CHECK(_verbose, _display != 0);
+  if(_selected)
+    return;
+
+  select_state_events();
+
+  stat_scope stat(*this, STAT_SELECT_EVENTS, false);
+  unsigned long mask = XkbNewKeyboardNotifyMask | XkbNamesNotifyMask;
+  Bool bret = XkbSelectEvents(_display, _deviceId, mask, mask);
+  CHECK_MSG(_verbose, bret==True, "XkbSelectEvents failed");
+
+  // setxkbmap updates the rules property after uploading the keymap, so the
+  // keymap events alone may arrive before the new layout names are readable.
+  _rulesAtom = XInternAtom(_display, "_XKB_RULES_NAMES", False);
+  stat.round_trip();
+
+  // XSelectInput() replaces the mask of the whole client, keep the root
+  // window events selected by other code sharing the connection
+  Window root = DefaultRootWindow(_display);
+  XWindowAttributes attrs;
+  long rootMask = 0;
+  if(XGetWindowAttributes(_display, root, &attrs))
+    rootMask = attrs.your_event_mask;
+  // The attributes and the geometry of the window
+  stat.round_trip();
+  stat.round_trip();
+  XSelectInput(_display, root, rootMask | PropertyChangeMask);
+
+  _selected = true;
+}
 
-  return make_pair(string(vdr._it.layout ? vdr._it.layout : "us"),
-                   string(vdr._it.variant ? vdr._it.variant : ""));
+void XKeyboard::select_device_events(const std::vector<int>& ids)
+{
+  select_events();
+
+  stat_scope stat(*this, STAT_SELECT_EVENTS, false);
+  for(size_t i = 0; i < ids.size(); i++) {
+    if(std::find(_devices.begin(), _devices.end(), ids[i]) != _devices.end())
+      continue;
+    Bool bret = XkbSelectEventDetails(_display, ids[i],
+        XkbStateNotify, XkbAllStateComponentsMask, XkbGroupStateMask);
+    CHECK_MSG(_verbose, bret==True, "XkbSelectEventDetails failed for device " << ids[i]);
+    _devices.push_back(ids[i]);
+  }
 }
 
-void XKeyboard::build_layout_from(string_vector& out, const layout_variant_strings& lv)
+int XKeyboard::get_device_group(int id) const
 {
-  std::istringstream layout(lv.first);
-  std::istringstream variant(lv.second);
+  if(std::find(_devices.begin(), _devices.end(), id) != _devices.end()) {
+    process_events();
+    std::map<int, int>::const_iterator i = _deviceGroups.find(id);
+    if(i != _deviceGroups.end())
+      return i->second;
+  }
 
-  out.clear();
+  stat_scope stat(*this, STAT_GET_GROUP, true);
+  XkbStateRec xkbState;
+  CHECK_MSG(_verbose, XkbGetState(_display, id, &xkbState) == Success,
+      "Failed to get the state of device " << id);
+  if(std::find(_devices.begin(), _devices.end(), id) != _devices.end()) {
+    // Events selected before the query keep the value fresh
+    _deviceGroups[id] = xkbState.group;
+  }
+  return static_cast<int>(xkbState.group);
+}
 
-  while(true) {
-    string l,v;
+void XKeyboard::enable_cache()
+{
+  CHECK(_verbose, _display != 0);
+  if(_cached)
+    return;
 
-    getline(layout, l, ',');
-    getline(variant, v, ',');
-    MSG(_verbose, "layout \"" << l << "\", variant \"" << v << "\"");
-    if(!layout && !variant) {
-      break;
-    }
+  select_events();
+  _group = get_group();
+  invalidate_names();
+  _cached = true;
+}
 
-    if(v!="") {
-      v = "(" + v + ")";
+event_kind XKeyboard::handle_event(const XEvent& event) const
+{
+  event_kind kind = dispatch_event(event);
+  if(_observer && kind != EVENT_NONE)
+    _observer(*this, event, kind, _observerArg);
+  return kind;
+}
+
+event_kind XKeyboard::dispatch_event(const XEvent& event) const
+{
+  _stats.events++;
+  if(event.type == _eventBase) {
+    const XkbEvent& xkbEvent = reinterpret_cast<const XkbEvent&>(event);
+    _eventTime = xkbEvent.any.time;
+    _eventSerial = xkbEvent.any.serial;
+    _eventDevice = xkbEvent.any.device;
+    switch(xkbEvent.any.xkb_type) {
+      case XkbStateNotify:
+        if(!_devices.empty()) {
+          _deviceGroups[_eventDevice] = xkbEvent.state.group;
+          if(_eventDevice != _deviceId) {
+            MSG(_verbose, "State event of device " << _eventDevice << ", group " << xkbEvent.state.group);
+            return EVENT_STATE;
+          }
+        }
+        _prefetched &= ~QUERY_GROUP;
+        // Events generated before our own XkbLockGroup would overwrite the
+        // group we have just set
+        if(xkbEvent.any.serial >= _lockSerial) {
+          _group = xkbEvent.state.group;
+        }
+        MSG(_verbose, "State event, group " << xkbEvent.state.group);
+        return EVENT_STATE;
+      case XkbNamesNotify:
+        MSG(_verbose, "Names event");
+        invalidate_names();
+        return EVENT_NAMES;
+      case XkbNewKeyboardNotify:
+        MSG(_verbose, "Keymap event");
+        invalidate_names();
+        return EVENT_KEYMAP;
+      default:
+        return EVENT_NONE;
     }
-    if(l!="") {
-      MSG(_verbose, "... accepting with id #" << out.size());
-      out.push_back(l+v);
+  }
+  else if(event.type == PropertyNotify && event.xproperty.atom == _rulesAtom) {
+    MSG(_verbose, "Rules property changed");
+    _eventTime = event.xproperty.time;
+    invalidate_names();
+    return EVENT_RULES;
+  }
+  else if(event.type == PropertyNotify && _historyAtom != None &&
+          event.xproperty.atom == _historyAtom) {
+    // Our own writes come back in order, with the serials of the requests
+    unsigned long serial = event.xproperty.serial;
+    int done = 0;
+    while(done < _historyWrites && _historySerials[done] < serial)
+      done++;
+    if(done < _historyWrites && _historySerials[done] == serial) {
+      done++;
     }
     else {
-      MSG(_verbose, "... ignoring");
+      MSG(_verbose, "History changed by another client");
+      _historyValid = false;
+      _prefetched &= ~QUERY_HISTORY;
     }
+    std::copy(_historySerials + done, _historySerials + _historyWrites, _historySerials);
+    _historyWrites -= done;
   }
+  return EVENT_NONE;
 }
 
+void XKeyboard::invalidate_names() const
+{
+  _prefetched = 0;
+  _layoutValid = false;
+  _longNamesValid = false;
+  _generation++;
+}
 
-void XKeyboard::build_layout(string_vector& out)
+void XKeyboard::process_events() const
 {
-  layout_variant_strings lv=this->get_layout_variant();
-  build_layout_from(out, lv);
+  CHECK(_verbose, _display != 0 || _backend != 0);
+  // Without a display all events are injected with handle_event()
+  while(_display != 0 && XPending(_display)) {
+    XEvent event;
+    XNextEvent(_display, &event);
+    handle_event(event);
+  }
 }
 
-void XKeyboard::wait_event()
+event_kind XKeyboard::wait_event(int timeout_ms, int mask, unsigned long min_serial)
 {
   CHECK(_verbose, _display != 0);
+  if(mask == EVENT_STATE)
+    select_state_events();
+  else
+    select_events();
 
-  Bool bret = XkbSelectEventDetails(_display, XkbUseCoreKbd,
-      XkbStateNotify, XkbAllStateComponentsMask, XkbGroupStateMask);
-  CHECK_MSG(_verbose, bret==True, "XkbSelectEventDetails failed");
+  stat_scope stat(*this, STAT_WAIT_EVENT, false);
+  timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
 
-  XEvent event;
-  int iret = XNextEvent(_display, &event);
-  CHECK_MSG(_verbose, iret==0, "XNextEvent failed with " << iret);
+  while(true) {
+    while(XPending(_display)) {
+      XEvent event;
+      XNextEvent(_display, &event);
+      event_kind kind = handle_event(event);
+      if((kind & mask) && _eventSerial >= min_serial)
+        return kind;
+    }
+
+    int left = -1;
+    if(timeout_ms >= 0) {
+      timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      long spent = (now.tv_sec - start.tv_sec) * 1000 +
+                   (now.tv_nsec - start.tv_nsec) / 1000000;
+      if(spent >= timeout_ms)
+        return EVENT_NONE;
+      left = timeout_ms - spent;
+    }
+
+    pollfd pfd;
+    pfd.fd = ConnectionNumber(_display);
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int iret = poll(&pfd, 1, left);
+    if(iret < 0 && errno == EINTR)
+      return EVENT_NONE;
+    CHECK_MSG(_verbose, iret >= 0, "poll() failed: " << strerror(errno));
+  }
 }
 
-void XKeyboard::set_group(int groupNum)
+void XKeyboard::set_group(int groupNum, bool flush)
+{
+  CHECK(_verbose, _display != 0);
+  if(_cached)
+    process_events();
+
+  // The previous group goes to the history too, as it may have been locked
+  // by other means. Whatever isn't known yet is asked for with one query.
+  int previous = _group;
+  int mask = history_valid() ? 0 : QUERY_HISTORY;
+  if(!_cached && !(_prefetched & QUERY_GROUP))
+    mask |= QUERY_GROUP;
+  if(mask != 0) {
+    xkb_query q(mask);
+    run_query(q, STAT_QUERY);
+    if(mask & QUERY_GROUP)
+      previous = q.group;
+    take_history(q);
+  }
+
+  stat_scope stat(*this, STAT_SET_GROUP, false);
+  queue_lock(groupNum);
+  record_group(previous, groupNum);
+  if(flush)
+    XFlush(_display);
+}
+
+void XKeyboard::lock_group(int groupNum, bool flush)
+{
+  CHECK(_verbose, _display != 0);
+  stat_scope stat(*this, STAT_SET_GROUP, false);
+  queue_lock(groupNum);
+  if(flush)
+    XFlush(_display);
+}
+
+void XKeyboard::queue_lock(int groupNum)
 {
   Bool result = XkbLockGroup(_display, _deviceId, groupNum);
   CHECK(_verbose, result == True);
-  XFlush(_display);
+  // Read the serial after the lock is queued: requests the XCB backend sent
+  // on the shared connection only enter Xlib's counter when Xlib takes the
+  // socket back, which queueing the lock does
+  _lockSerial = NextRequest(_display) - 1;
+  _group = groupNum;
 }
 
-int XKeyboard::get_group() const
+bool XKeyboard::history_valid() const
 {
-  XkbStateRec xkbState;
-  XkbGetState(_display, _deviceId, &xkbState);
-  return static_cast<int>(xkbState.group);
+  return _cached ? _historyValid : (_prefetched & QUERY_HISTORY) != 0;
 }
 
-std::string XKeyboard::get_long_group_name() const
+void XKeyboard::take_history(const xkb_query& q) const
 {
-  if (_display == nullptr) {
-    throw std::runtime_error("Display not opened.");
+  if(!(q.mask & QUERY_HISTORY))
+    return;
+  _history = q.history;
+  _historyAtom = q.historyAtom;
+  _historyValid = true;
+  _prefetched |= QUERY_HISTORY;
+}
+
+const group_history& XKeyboard::history() const
+{
+  if(_cached)
+    process_events();
+  if(!history_valid()) {
+    xkb_query q(QUERY_HISTORY);
+    run_query(q, STAT_QUERY);
+    take_history(q);
   }
+  return _history;
+}
 
-  XkbStateRec xkbState;
+void XKeyboard::record_group(int previous, int groupNum)
+{
+  CHECK(_verbose, _display != 0);
+  group_history h = _history;
+  int front[2] = {previous, groupNum};
+  for(int i = 0; i < 2; i++) {
+    int g = front[i];
+    if(g < 0 || g >= XkbNumKbdGroups)
+      continue;
+    int* end = std::remove(h.groups, h.groups + h.count, g);
+    h.count = end - h.groups;
+    std::copy_backward(h.groups, end, end + 1);
+    h.groups[0] = g;
+    h.count++;
+  }
+  if(h.count == _history.count && std::equal(h.groups, h.groups + h.count, _history.groups))
+    return;
+
+  if(_historyAtom == None)
+    _historyAtom = XInternAtom(_display, history_atom_name, False);
+  long values[XkbNumKbdGroups];
+  std::copy(h.groups, h.groups + h.count, values);
+  XChangeProperty(_display, DefaultRootWindow(_display), _historyAtom, XA_CARDINAL, 32,
+      PropModeReplace, reinterpret_cast<unsigned char*>(values), h.count);
+  _history = h;
+
+  // Forget the oldest write if too many are in flight, its event then looks
+  // foreign and only costs a read
+  if(_historyWrites == HISTORY_WRITES) {
+    std::copy(_historySerials + 1, _historySerials + _historyWrites, _historySerials);
+    _historyWrites--;
+  }
+  _historySerials[_historyWrites++] = NextRequest(_display) - 1;
+}
 
-  if (XkbGetState(_display, _deviceId, &xkbState) != Success) {
-    throw std::runtime_error("Failed to get keyboard state.");
+group_change XKeyboard::set_group_confirm(int groupNum, int timeout_ms)
+{
+  CHECK(_verbose, _display != 0);
+  select_state_events();
+  set_group(groupNum);
+  return confirm_group(groupNum, timeout_ms);
+}
+
+group_change XKeyboard::confirm_group(int groupNum, int timeout_ms)
+{
+  group_change change;
+  change.group = groupNum;
+  change.time = CurrentTime;
+  change.confirmed = false;
+
+  // The lock generates no event if the group doesn't change
+  if(wait_event(timeout_ms, EVENT_STATE, _lockSerial) != EVENT_NONE) {
+    change.group = _group;
+    change.time = _eventTime;
+    change.confirmed = true;
   }
+  else {
+    MSG(_verbose, "No state event after the lock, asking the server");
+    _prefetched &= ~QUERY_GROUP;
+    change.group = get_group();
+  }
+
+  _group = change.group;
+  _prefetched |= QUERY_GROUP;
+  return change;
+}
 
-  XkbDescPtr descPtr = XkbGetKeyboard(_display, XkbAllComponentsMask, _deviceId);
-  if (descPtr == nullptr) {
-    throw std::runtime_error("Failed to get keyboard description.");
+void XKeyboard::flush()
+{
+  CHECK(_verbose, _display != 0);
+  XFlush(_display);
+}
+
+int XKeyboard::get_group() const
+{
+  if(_cached) {
+    process_events();
+    return _group;
+  }
+  if(_prefetched & QUERY_GROUP) {
+    return _group;
   }
+  xkb_query q(QUERY_GROUP);
+  run_query(q, STAT_GET_GROUP);
+  return q.group;
+}
 
-  XkbKeyboardWrapper desc(descPtr);
+void XKeyboard::run_query(xkb_query& q, stat_method method) const
+{
+  CHECK(_verbose, _backend != 0);
+  stat_scope stat(*this, method, false);
+  try {
+    _backend->query(q);
+  }
+  catch(...) {
+    stat.count(q.requests, q.round_trips);
+    throw;
+  }
+  stat.count(q.requests, q.round_trips);
+}
 
-  if (desc.ptr->names == nullptr) {
-    throw std::runtime_error("Failed to get keyboard names.");
+void XKeyboard::prefetch(int mask)
+{
+  _prefetched = 0;
+  if(mask == 0)
+    return;
+
+  xkb_query q(mask);
+  run_query(q, STAT_QUERY);
+  if(mask & QUERY_GROUP) {
+    _group = q.group;
+  }
+  if(mask & QUERY_RULES) {
+    _layoutVariant = q.lv;
+    _layoutValid = false;
+  }
+  if(mask & QUERY_NAMES) {
+    _longNames.swap(q.names);
+    _longNamesValid = true;
   }
+  _prefetched = mask;
+  take_history(q);
+}
 
-  Status ErrorGetControls = XkbGetControls(_display, XkbAllComponentsMask, desc.ptr);
-  if (ErrorGetControls != Success || desc.ptr->ctrls == nullptr) {
-    throw std::runtime_error("Failed to get keyboard controls.");
+std::string XKeyboard::get_long_group_name() const
+{
+  int both = QUERY_GROUP | QUERY_NAMES;
+  if (!_cached && (_prefetched & both) != both) {
+    // Ask for the group and the names together
+    xkb_query q(both);
+    run_query(q, STAT_GROUP_NAMES);
+    _longNames.swap(q.names);
+    _longNamesValid = true;
+    if (q.group >= static_cast<int>(_longNames.size())) {
+      throw std::runtime_error("Group index out of range.");
+    }
+    return _longNames[q.group];
   }
 
-  int num_groups = desc.ptr->ctrls->num_groups;
-  if (xkbState.group >= num_groups) {
+  const string_vector& names = group_names();
+
+  int group = get_group();
+  if (group >= static_cast<int>(names.size())) {
     throw std::runtime_error("Group index out of range.");
   }
 
-  XGetAtomNameWrapper groupName(_display, desc.ptr->names->groups[xkbState.group]);
-  if (groupName.ptr == nullptr) {
-    throw std::runtime_error("Failed to get group name.");
+  return names[group];
+}
+
+void XKeyboard::build_long_names(string_vector& out) const
+{
+  out = group_names();
+}
+
+const string_vector& XKeyboard::group_names() const
+{
+  if (_backend == nullptr) {
+    throw std::runtime_error("Display not opened.");
+  }
+
+  if (_cached && _longNamesValid) {
+    process_events();
+    if (_longNamesValid) {
+      return _longNames;
+    }
   }
 
-  std::string longGroupName = groupName.ptr;
+  if (_prefetched & QUERY_NAMES) {
+    return _longNames;
+  }
 
-  return longGroupName;
+  xkb_query q(QUERY_NAMES);
+  run_query(q, STAT_GROUP_NAMES);
+  _longNames.swap(q.names);
+  _longNamesValid = true;
+  return _longNames;
 }
 
-
+const XkbDescRec* XKeyboard::keymap()
+{
+  CHECK_MSG(_verbose, _display != 0 && _kbdDescPtr != NULL,
+      "Key symbols are only available from an X server");
+  if(_cached) {
+    process_events();
+  }
+  if(!_keymapValid || _keymapGeneration != _generation) {
+    stat_scope stat(*this, STAT_KEYMAP, true);
+    if(_kbdDescPtr->min_key_code == 0) {
+      int minKey, maxKey;
+      XDisplayKeycodes(_display, &minKey, &maxKey);
+      _kbdDescPtr->min_key_code = minKey;
+      _kbdDescPtr->max_key_code = maxKey;
+    }
+    CHECK_MSG(_verbose,
+        XkbGetUpdatedMap(_display, XkbKeyTypesMask | XkbKeySymsMask, _kbdDescPtr) == Success &&
+        _kbdDescPtr->map != NULL, "Failed to get the key symbols.");
+    _keymapValid = true;
+    _keymapGeneration = _generation;
+  }
+  return _kbdDescPtr;
+}
 
 // returns true if symbol is ok
 bool filter(const string_vector& nonsyms, const std::string& symbol)
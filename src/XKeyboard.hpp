@@ -36,31 +36,194 @@
 #include <map>
 #include <string>
 
+#include "LayoutTable.hpp"
+
 namespace kb {
 
-typedef std::vector<std::string> string_vector;
-typedef std::pair<std::string,std::string> layout_variant_strings;
+// Kinds of keyboard events, usable as a bit mask
+enum event_kind {
+  EVENT_NONE = 0,     // Not a keyboard event, or the wait timed out
+  EVENT_STATE = 1,    // Effective group changed
+  EVENT_NAMES = 2,    // Group or other names changed
+  EVENT_KEYMAP = 4,   // New keyboard description was loaded
+  EVENT_RULES = 8,    // The _XKB_RULES_NAMES root property changed
+  EVENT_ANY = 15,
+};
+
+// Items of a combined query, usable as a bit mask, see prefetch()
+enum query_kind {
+  QUERY_GROUP = 1,    // Current group
+  QUERY_RULES = 2,    // Layout and variant strings of the rules property
+  QUERY_NAMES = 4,    // Fancy group names
+  QUERY_HISTORY = 8,  // Most recently used groups, see GroupHistory
+};
+
+// Instrumented XKeyboard methods
+enum stat_method {
+  STAT_OPEN_DISPLAY,
+  STAT_SELECT_EVENTS,
+  STAT_GET_GROUP,
+  STAT_SET_GROUP,
+  STAT_GET_LAYOUT_VARIANT,
+  STAT_GROUP_NAMES,
+  STAT_WAIT_EVENT,
+  STAT_QUERY,
+  STAT_KEYMAP,
+  STAT_METHODS,
+};
+
+// Per-method counters
+struct method_stats {
+  unsigned long calls;
+  unsigned long requests;     // X requests sent
+  unsigned long round_trips;  // Requests the method had to wait a reply for
+  double time_us;             // Wall time spent in the method
+};
+
+// Counters of the X traffic caused by an XKeyboard
+struct xstats {
+  unsigned long requests;
+  unsigned long round_trips;
+  unsigned long events;       // Events handled
+  method_stats methods[STAT_METHODS];
+};
+
+// Prints the counters in a "name key=value ..." form, a line per method
+void print_stats(std::ostream& out, const xstats& stats);
+
+// Outcome of XKeyboard::set_group_confirm()
+struct group_change {
+  int group;        // Group reported by the server after the lock
+  Time time;        // Server time of the change, CurrentTime if not confirmed
+  bool confirmed;   // The StateNotify caused by the lock arrived in time
+};
+
+// Most recently used groups, the current one first, as kept in the
+// _XKB_SWITCH_MRU root window property
+struct group_history {
+  int count;
+  int groups[XkbNumKbdGroups];
+};
+
+// Root window property holding the group history
+static const char history_atom_name[] = "_XKB_SWITCH_MRU";
+
+class XBackend;
+struct xkb_query;
+class XKeyboard;
+
+// Called for every keyboard event after the keyboard has handled it
+typedef void (*event_observer)(const XKeyboard& xkb, const XEvent& event,
+                               event_kind kind, void* arg);
 
 class XKeyboard
 {
 public:
 
   Display* _display;
+  std::string _displayName;  // As given to open_display()
   int _deviceId;
   XkbDescRec* _kbdDescPtr;
   size_t _verbose;
+  int _eventBase;
+  XBackend* _backend;
 
   XKeyboard(size_t verbose);
   ~XKeyboard();
 
-  // Opens display (or throw std::runtime_error)
-  void open_display(void);
+  // Opens the display, the one of $DISPLAY if the name is empty (or throw
+  // std::runtime_error)
+  void open_display(const std::string& name = std::string());
+
+  // Uses the backend instead of a display connection and takes ownership of
+  // it. The keyboard is in cache mode, events are injected with
+  // handle_event() and groups can't be locked. For tests and benchmarks.
+  void open_backend(XBackend* backend);
+
+  // Directs all further requests to the XKB device instead of the core
+  // keyboard. Must be called before subscribing to events.
+  void set_device(int id);
+
+  // Returns the file descriptor of the X connection, suitable for poll()
+  int fd() const;
+
+  // Subscribes to group changes only, costs no round trip. Does nothing if
+  // already subscribed.
+  void select_state_events();
+
+  // Subscribes to group changes of every listed device in addition to
+  // select_events(). Their groups are kept up to date by the events, then
+  // get_device_group() costs no round trips. Afterwards get_group() follows
+  // the events of _deviceId only if it was set with set_device().
+  void select_device_events(const std::vector<int>& ids);
+
+  // Returns the group of the device
+  int get_device_group(int id) const;
+
+  // Subscribes to XKB state, names and keymap events, and to changes of the
+  // rules property. Does nothing if already subscribed.
+  void select_events();
+
+  // Subscribes to events. Afterwards get_group() and build_layout() are
+  // served from the local copy which is kept up to date by incoming events.
+  void enable_cache();
+
+  // Updates the cache according to the event, returns its kind. Keyboard
+  // events are passed to _observer afterwards.
+  event_kind handle_event(const XEvent& event) const;
+  event_kind dispatch_event(const XEvent& event) const;
+
+  // Handles the events already received from the server, doesn't block
+  void process_events() const;
+
+  // Marks cached layout names as outdated and advances _generation
+  void invalidate_names() const;
+
+  // Fetches the items of the mask (see query_kind) with one combined query.
+  // Subsequent calls of get_group(), get_layout_variant() and group_names()
+  // return the fetched values instead of asking the server until an event is
+  // handled or the next prefetch().
+  void prefetch(int mask);
+
+  // Runs the query on the backend, accounting it to the method
+  void run_query(xkb_query& q, stat_method method) const;
 
   // Gets the current layout
   int get_group() const;
 
-  // Sets the layout
-  void set_group(int num);
+  // Sets the layout and records it in the group history, see record_group().
+  // Costs no round trip and no grab if the history and the group are cached
+  // or prefetched, otherwise one combined query reads them first (a round
+  // trip with the XCB backend). Without flush the requests stay
+  // in the output buffer until flush() or any other request waiting for a
+  // reply.
+  void set_group(int num, bool flush = true);
+
+  // Sets the layout without touching the history
+  void lock_group(int num, bool flush = true);
+
+  // Returns the group history, cached (see enable_cache()) or prefetched,
+  // asking the server otherwise
+  const group_history& history() const;
+
+  // Moves the previous and then the new group to the front of the history
+  // and queues the write of the property, without reading it or grabbing
+  // the server. Concurrent writers may lose an entry, GroupHistory grabs the
+  // server around the read for the switches that depend on the history.
+  void record_group(int previous, int group);
+
+  // Sets the layout and waits at most timeout_ms milliseconds for the state
+  // event caused by the lock. If the event doesn't arrive in time, asks the
+  // server for the current group. Afterwards get_group() returns the reported
+  // group without a round trip.
+  group_change set_group_confirm(int num, int timeout_ms);
+
+  // Second half of set_group_confirm(): waits for the state event caused by
+  // the last set_group(). The state events must be selected before the lock.
+  group_change confirm_group(int num, int timeout_ms);
+
+  // Sends buffered requests to the server
+  void flush();
 
   // Return layout/variant strings
   layout_variant_strings get_layout_variant();
@@ -69,11 +232,121 @@ public:
   void build_layout_from(string_vector& vec, const layout_variant_strings& lv);
   void build_layout(string_vector& vec);
 
+  // Returns the layout table, cached if enable_cache() was called
+  const LayoutTable& layout_table();
+
+  // Same as layout_table(), as a vector of names
+  const string_vector& layout();
+
   // Returns fancy layout name as a string
   std::string get_long_group_name() const;
 
-  // Waits for kb event
-  void wait_event();
+  // Returns fancy names of all groups
+  void build_long_names(string_vector& vec) const;
+
+  // Returns the table of fancy group names. Only the group name atoms and the
+  // group count are requested and all atoms are resolved in one request. The
+  // table is kept until the names change (cache mode) or the next call.
+  const string_vector& group_names() const;
+
+  // Returns the keyboard description filled with the key types and symbols
+  // of all keys. They are fetched again after the keymap changes (cache mode)
+  // and kept otherwise.
+  const XkbDescRec* keymap();
+
+  // Waits for a keyboard event of one of the kinds in the mask, at most
+  // timeout_ms milliseconds (forever if negative). Events with serials below
+  // min_serial are handled but don't end the wait. Returns the kind of the
+  // event or EVENT_NONE on timeout or if a signal interrupted the wait.
+  event_kind wait_event(int timeout_ms = -1, int mask = EVENT_ANY,
+                        unsigned long min_serial = 0);
+
+  // Group as of the last handled event in cache mode, without handling the
+  // pending events like get_group() does
+  int group() const { return _group; }
+
+  // Server time of the last handled event
+  Time event_time() const { return _eventTime; }
+
+  // Advanced every time the names become outdated, see invalidate_names()
+  unsigned long generation() const { return _generation; }
+
+  // The cached layout names are up to date
+  bool layout_valid() const { return _layoutValid; }
+
+  // Devices selected with select_device_events()
+  const std::vector<int>& devices() const { return _devices; }
+
+  // Atom of the rules property, None until select_events()
+  Atom rules_atom() const { return _rulesAtom; }
+
+  // Counters of the X traffic, see print_stats()
+  const xstats& stats() const { return _stats; }
+
+  // Sets the observer called by handle_event(), NULL for none
+  void set_observer(event_observer observer, void* arg)
+  {
+    _observer = observer;
+    _observerArg = arg;
+  }
+
+private:
+  friend struct stat_scope;
+
+  // Event selection, see select_events()
+  bool _stateSelected;
+  bool _selected;
+
+  // State cache, see enable_cache()
+  bool _cached;
+  mutable int _group;
+  mutable Time _eventTime;  // Server time of the last handled event
+  mutable unsigned long _eventSerial;  // Serial of the last handled event
+  mutable bool _layoutValid;
+  mutable unsigned long _generation;
+  mutable bool _longNamesValid;
+  mutable string_vector _longNames;
+  mutable LayoutTable _table;
+  mutable string_vector _layout;
+  bool _keymapValid;
+  unsigned long _keymapGeneration;  // _generation the key symbols were fetched at
+  unsigned long _lockSerial;
+  Atom _rulesAtom;
+
+  // Group history, see record_group(). The serials of our own writes tell
+  // their PropertyNotify events apart from changes made by other clients.
+  enum { HISTORY_WRITES = 8 };
+  mutable Atom _historyAtom;
+  mutable group_history _history;
+  mutable bool _historyValid;
+  mutable unsigned long _historySerials[HISTORY_WRITES];
+  mutable int _historyWrites;
+
+  // Per-device state, see select_device_events()
+  std::vector<int> _devices;
+  mutable std::map<int, int> _deviceGroups;
+  mutable int _eventDevice;  // Device of the last handled event
+
+  // Results of the last prefetch(), valid until the next event
+  mutable int _prefetched;
+  mutable layout_variant_strings _layoutVariant;
+
+  // Instrumentation, see print_stats()
+  mutable xstats _stats;
+
+  // Event observer, see handle_event()
+  event_observer _observer;
+  void* _observerArg;
+
+  // Queues the lock of the group
+  void queue_lock(int num);
+
+  // Takes the history of a query
+  void take_history(const xkb_query& q) const;
+
+  // The history is up to date in cache mode until another client changes
+  // it, otherwise until the next prefetch()
+  bool history_valid() const;
 };
 
 }
@@ -0,0 +1,298 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** XKeyboard backend sending the requests of a query together over XCB
+ *
+ * The requests go through the XCB connection underlying the Xlib display, so
+ * events keep arriving through Xlib. A query costs one round trip; only group
+ * names not seen before cost a second one, atom names are kept for the life
+ * of the connection.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <vector>
+#include <sstream>
+
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#include <xcb/xkb.h>
+
+#include "XBackend.hpp"
+#include "Utils.hpp"
+
+using namespace std;
+
+namespace kb {
+
+// Frees an XCB reply (or error) when leaving the scope
+template<class T>
+struct xcb_reply_ptr {
+  T* p;
+  xcb_reply_ptr(T* r = NULL) : p(r) {}
+  ~xcb_reply_ptr() { free(p); }
+  T* operator->() const { return p; }
+  // Disable copying
+  xcb_reply_ptr(const xcb_reply_ptr&) = delete;
+  xcb_reply_ptr& operator=(const xcb_reply_ptr&) = delete;
+};
+
+class XcbBackend : public XBackend
+{
+public:
+  const XKeyboard& _xkb;
+  xcb_connection_t* _conn;
+  xcb_atom_t _rulesAtom;
+  xcb_atom_t _historyAtom;
+  std::map<xcb_atom_t, std::string> _atomNames;
+
+  XcbBackend(const XKeyboard& xkb)
+    : _xkb(xkb), _conn(XGetXCBConnection(xkb._display)), _rulesAtom(XCB_ATOM_NONE),
+      _historyAtom(XCB_ATOM_NONE)
+  {
+    CHECK_MSG(xkb._verbose, _conn != NULL, "Failed to get the XCB connection");
+  }
+
+  void query(xkb_query& q)
+  {
+    size_t verbose = _xkb._verbose;
+    xcb_xkb_device_spec_t device = static_cast<xcb_xkb_device_spec_t>(_xkb._deviceId);
+    xcb_window_t root = DefaultRootWindow(_xkb._display);
+    bool group = q.mask & QUERY_GROUP;
+    bool rules = q.mask & QUERY_RULES;
+    bool names = q.mask & QUERY_NAMES;
+    bool history = q.mask & QUERY_HISTORY;
+    bool intern = rules && _rulesAtom == XCB_ATOM_NONE;
+    bool internHistory = history && _historyAtom == XCB_ATOM_NONE;
+
+    // First round: every request not depending on other replies
+    xcb_xkb_get_state_cookie_t stateCookie = {0};
+    xcb_intern_atom_cookie_t internCookie = {0};
+    xcb_intern_atom_cookie_t internHistoryCookie = {0};
+    xcb_get_property_cookie_t propCookie = {0};
+    xcb_get_property_cookie_t historyCookie = {0};
+    xcb_xkb_get_names_cookie_t namesCookie = {0};
+    xcb_xkb_get_controls_cookie_t ctrlsCookie = {0};
+
+    if(group) {
+      stateCookie = xcb_xkb_get_state(_conn, device);
+      q.requests++;
+    }
+    if(intern) {
+      internCookie = xcb_intern_atom(_conn, 0, strlen(rules_atom_name), rules_atom_name);
+      q.requests++;
+    }
+    else if(rules) {
+      propCookie = get_rules(root, 1024);
+      q.requests++;
+    }
+    if(internHistory) {
+      internHistoryCookie = xcb_intern_atom(_conn, 0, strlen(history_atom_name),
+                                            history_atom_name);
+      q.requests++;
+    }
+    else if(history) {
+      historyCookie = get_history(root);
+      q.requests++;
+    }
+    if(names) {
+      namesCookie = xcb_xkb_get_names(_conn, device, XCB_XKB_NAME_DETAIL_GROUP_NAMES);
+      ctrlsCookie = xcb_xkb_get_controls(_conn, device);
+      q.requests += 2;
+    }
+    if(q.requests > 0) {
+      q.round_trips++;
+    }
+
+    if(group) {
+      xcb_generic_error_t* err = NULL;
+      xcb_reply_ptr<xcb_xkb_get_state_reply_t> state(
+          xcb_xkb_get_state_reply(_conn, stateCookie, &err));
+      xcb_reply_ptr<xcb_generic_error_t> error(err);
+      CHECK_MSG(verbose, state.p != NULL, "Failed to get keyboard state");
+      q.group = state->group;
+    }
+
+    // Second round: the rules property if its atom was unknown, names of new
+    // group atoms
+    std::vector<xcb_atom_t> atoms;
+    if(names) {
+      collect_group_atoms(namesCookie, ctrlsCookie, atoms);
+    }
+    if(intern) {
+      xcb_generic_error_t* err = NULL;
+      xcb_reply_ptr<xcb_intern_atom_reply_t> reply(
+          xcb_intern_atom_reply(_conn, internCookie, &err));
+      xcb_reply_ptr<xcb_generic_error_t> error(err);
+      CHECK_MSG(verbose, reply.p != NULL, "Failed to intern " << rules_atom_name);
+      _rulesAtom = reply->atom;
+      propCookie = get_rules(root, 1024);
+      q.requests++;
+    }
+    if(internHistory) {
+      xcb_generic_error_t* err = NULL;
+      xcb_reply_ptr<xcb_intern_atom_reply_t> reply(
+          xcb_intern_atom_reply(_conn, internHistoryCookie, &err));
+      xcb_reply_ptr<xcb_generic_error_t> error(err);
+      CHECK_MSG(verbose, reply.p != NULL, "Failed to intern " << history_atom_name);
+      _historyAtom = reply->atom;
+      historyCookie = get_history(root);
+      q.requests++;
+    }
+
+    std::vector<xcb_atom_t> unknown;
+    std::vector<xcb_get_atom_name_cookie_t> atomCookies;
+    for(size_t i = 0; i < atoms.size(); i++) {
+      if(atoms[i] != XCB_ATOM_NONE && _atomNames.find(atoms[i]) == _atomNames.end() &&
+         std::find(unknown.begin(), unknown.end(), atoms[i]) == unknown.end()) {
+        unknown.push_back(atoms[i]);
+        atomCookies.push_back(xcb_get_atom_name(_conn, atoms[i]));
+        q.requests++;
+      }
+    }
+    if(intern || internHistory || !unknown.empty()) {
+      q.round_trips++;
+    }
+
+    if(rules) {
+      q.lv = read_rules(propCookie, root, q);
+    }
+    if(history) {
+      read_history(historyCookie, q);
+    }
+
+    for(size_t i = 0; i < unknown.size(); i++) {
+      xcb_generic_error_t* err = NULL;
+      xcb_reply_ptr<xcb_get_atom_name_reply_t> reply(
+          xcb_get_atom_name_reply(_conn, atomCookies[i], &err));
+      xcb_reply_ptr<xcb_generic_error_t> error(err);
+      if(reply.p == NULL) {
+        throw std::runtime_error("Failed to get group name.");
+      }
+      _atomNames[unknown[i]] = std::string(xcb_get_atom_name_name(reply.p),
+                                           xcb_get_atom_name_name_length(reply.p));
+    }
+
+    if(names) {
+      q.names.clear();
+      for(size_t i = 0; i < atoms.size(); i++) {
+        q.names.push_back(atoms[i] == XCB_ATOM_NONE ? "" : _atomNames[atoms[i]]);
+      }
+    }
+  }
+
+  xcb_get_property_cookie_t get_rules(xcb_window_t root, uint32_t words)
+  {
+    return xcb_get_property(_conn, 0, root, _rulesAtom, XCB_ATOM_STRING, 0, words);
+  }
+
+  xcb_get_property_cookie_t get_history(xcb_window_t root)
+  {
+    return xcb_get_property(_conn, 0, root, _historyAtom, XCB_ATOM_CARDINAL, 0,
+                            XkbNumKbdGroups);
+  }
+
+  // A missing or malformed history is empty
+  void read_history(xcb_get_property_cookie_t cookie, xkb_query& q)
+  {
+    xcb_reply_ptr<xcb_get_property_reply_t> prop(
+        xcb_get_property_reply(_conn, cookie, NULL));
+    q.historyAtom = _historyAtom;
+    q.history.count = 0;
+    if(prop.p != NULL && prop->format == 32 && prop->type == XCB_ATOM_CARDINAL) {
+      parse_history(static_cast<const uint32_t*>(xcb_get_property_value(prop.p)),
+                    xcb_get_property_value_length(prop.p) / 4, q.history);
+    }
+  }
+
+  // Returns the atoms of the groups, XCB_ATOM_NONE for unnamed ones
+  void collect_group_atoms(xcb_xkb_get_names_cookie_t namesCookie,
+                           xcb_xkb_get_controls_cookie_t ctrlsCookie,
+                           std::vector<xcb_atom_t>& atoms)
+  {
+    xcb_generic_error_t* err = NULL;
+    xcb_reply_ptr<xcb_xkb_get_names_reply_t> names(
+        xcb_xkb_get_names_reply(_conn, namesCookie, &err));
+    xcb_reply_ptr<xcb_generic_error_t> namesError(err);
+    err = NULL;
+    xcb_reply_ptr<xcb_xkb_get_controls_reply_t> ctrls(
+        xcb_xkb_get_controls_reply(_conn, ctrlsCookie, &err));
+    xcb_reply_ptr<xcb_generic_error_t> ctrlsError(err);
+    if(names.p == NULL) {
+      throw std::runtime_error("Failed to get keyboard names.");
+    }
+    if(ctrls.p == NULL) {
+      throw std::runtime_error("Failed to get keyboard controls.");
+    }
+
+    xcb_xkb_get_names_value_list_t list;
+    memset(&list, 0, sizeof(list));
+    xcb_xkb_get_names_value_list_unpack(xcb_xkb_get_names_value_list(names.p),
+        names->nTypes, names->indicators, names->virtualMods, names->groupNames,
+        names->nKeys, names->nKeyAliases, names->nRadioGroups, names->which,
+        &list);
+
+    // The reply lists the atoms of the groups whose bits are set
+    int num_groups = std::min<int>(ctrls->numGroups, XkbNumKbdGroups);
+    int listed = 0;
+    for(int group = 0; group < num_groups; group++) {
+      xcb_atom_t atom = XCB_ATOM_NONE;
+      if(names->groupNames & (1 << group)) {
+        atom = list.groups[listed++];
+      }
+      atoms.push_back(atom);
+    }
+  }
+
+  layout_variant_strings read_rules(xcb_get_property_cookie_t cookie,
+                                    xcb_window_t root, xkb_query& q)
+  {
+    size_t verbose = _xkb._verbose;
+    xcb_generic_error_t* err = NULL;
+    xcb_reply_ptr<xcb_get_property_reply_t> prop(
+        xcb_get_property_reply(_conn, cookie, &err));
+    xcb_reply_ptr<xcb_generic_error_t> error(err);
+    CHECK_MSG(verbose, prop.p != NULL && prop->format == 8,
+        "Failed to get keyboard properties");
+
+    if(prop->bytes_after > 0) {
+      // Rare long property, fetch it whole
+      uint32_t length = xcb_get_property_value_length(prop.p) + prop->bytes_after;
+      q.requests++;
+      q.round_trips++;
+      return read_rules(get_rules(root, (length + 3) / 4), root, q);
+    }
+
+    return parse_rules_names(static_cast<const char*>(xcb_get_property_value(prop.p)),
+                             xcb_get_property_value_length(prop.p), verbose);
+  }
+};
+
+XBackend* make_xcb_backend(const XKeyboard& xkb)
+{
+  return new XcbBackend(xkb);
+}
+
+}
@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** XKeyboard backend built on synchronous Xlib calls */
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include <X11/Xatom.h>
+#include <X11/XKBlib.h>
+
+#include "XBackend.hpp"
+#include "Utils.hpp"
+
+using namespace std;
+
+namespace kb {
+
+void split_rules_names(const char* data, size_t length, string fields[5])
+{
+  // Rules, model, layout, variant and options separated by NULs
+  const char* p = data;
+  const char* end = data + length;
+  for(int field = 0; field < 5; field++) {
+    fields[field].clear();
+    if(p >= end)
+      continue;
+    const char* nul = static_cast<const char*>(memchr(p, '\0', end - p));
+    fields[field].assign(p, (nul ? nul : end) - p);
+    p += fields[field].size() + 1;
+  }
+}
+
+layout_variant_strings parse_rules_names(const char* data, size_t length, size_t verbose)
+{
+  string fields[5];
+  split_rules_names(data, length, fields);
+  const string& layout = fields[2];
+  const string& variant = fields[3];
+  MSG(verbose, "raw layout string \"" << layout << "\"");
+  MSG(verbose, "raw variant string \"" << variant << "\"");
+
+  return make_pair(layout.empty() ? string("us") : layout, variant);
+}
+
+// Frees the data returned by XGetWindowProperty
+struct XPropertyWrapper {
+  unsigned char* data;
+  XPropertyWrapper() : data(NULL) {}
+  ~XPropertyWrapper() {
+    if (data) {
+      XFree(data);
+    }
+  }
+  // Disable copying
+  XPropertyWrapper(const XPropertyWrapper&) = delete;
+  XPropertyWrapper& operator=(const XPropertyWrapper&) = delete;
+};
+
+// Frees the strings returned by XGetAtomNames
+struct XGetAtomNamesWrapper {
+  char* names[XkbNumKbdGroups];
+  int count;
+  XGetAtomNamesWrapper() : count(0) {
+    std::memset(names, 0, sizeof(names));
+  }
+  ~XGetAtomNamesWrapper() {
+    for (int i = 0; i < count; i++) {
+      if (names[i]) {
+        XFree(names[i]);
+      }
+    }
+  }
+  // Disable copying
+  XGetAtomNamesWrapper(const XGetAtomNamesWrapper&) = delete;
+  XGetAtomNamesWrapper& operator=(const XGetAtomNamesWrapper&) = delete;
+};
+
+class XlibBackend : public XBackend
+{
+public:
+  const XKeyboard& _xkb;
+  Atom _rulesAtom;
+  Atom _historyAtom;
+
+  XlibBackend(const XKeyboard& xkb) : _xkb(xkb), _rulesAtom(None), _historyAtom(None) {}
+
+  void query(xkb_query& q)
+  {
+    Display* display = _xkb._display;
+    unsigned long first = NextRequest(display);
+
+    if(q.mask & QUERY_GROUP) {
+      q.round_trips++;
+      XkbStateRec xkbState;
+      XkbGetState(display, _xkb._deviceId, &xkbState);
+      q.group = static_cast<int>(xkbState.group);
+    }
+    if(q.mask & QUERY_RULES) {
+      q.lv = get_layout_variant(q);
+    }
+    if(q.mask & QUERY_NAMES) {
+      get_group_names(q);
+    }
+    if(q.mask & QUERY_HISTORY) {
+      get_history(q);
+    }
+
+    q.requests += NextRequest(display) - first;
+  }
+
+  layout_variant_strings get_layout_variant(xkb_query& q)
+  {
+    size_t verbose = _xkb._verbose;
+    Display* display = _xkb._display;
+
+    if(_rulesAtom == None) {
+      q.round_trips++;
+      _rulesAtom = XInternAtom(display, rules_atom_name, True);
+      CHECK_MSG(verbose, _rulesAtom != None, "Failed to get keyboard properties");
+    }
+
+    // The property is short, one request normally reads it whole
+    long words = 1024;
+    while(true) {
+      XPropertyWrapper prop;
+      Atom type;
+      int format;
+      unsigned long items, bytes_after;
+      q.round_trips++;
+      int iret = XGetWindowProperty(display, DefaultRootWindow(display),
+          _rulesAtom, 0, words, False, XA_STRING, &type, &format, &items,
+          &bytes_after, &prop.data);
+      CHECK_MSG(verbose, iret == Success && type == XA_STRING && format == 8,
+          "Failed to get keyboard properties");
+      if(bytes_after > 0) {
+        words = (items + bytes_after + 3) / 4;
+        continue;
+      }
+      return parse_rules_names(reinterpret_cast<const char*>(prop.data), items, verbose);
+    }
+  }
+
+  void get_history(xkb_query& q)
+  {
+    Display* display = _xkb._display;
+
+    if(_historyAtom == None) {
+      q.round_trips++;
+      _historyAtom = XInternAtom(display, history_atom_name, False);
+    }
+    q.historyAtom = _historyAtom;
+
+    XPropertyWrapper prop;
+    Atom type;
+    int format;
+    unsigned long items, bytes_after;
+    q.round_trips++;
+    q.history.count = 0;
+    if(XGetWindowProperty(display, DefaultRootWindow(display), _historyAtom, 0,
+          XkbNumKbdGroups, False, XA_CARDINAL, &type, &format, &items,
+          &bytes_after, &prop.data) == Success && prop.data != NULL &&
+       type == XA_CARDINAL && format == 32) {
+      // Format 32 items are longs on the client side
+      parse_history(reinterpret_cast<const long*>(prop.data), items, q.history);
+    }
+  }
+
+  void get_group_names(xkb_query& q)
+  {
+    Display* display = _xkb._display;
+    XkbDescRec* desc = _xkb._kbdDescPtr;
+
+    // Only group names and the group count are requested, not the whole keymap
+    q.round_trips++;
+    if (XkbGetNames(display, XkbGroupNamesMask, desc) != Success ||
+        desc->names == nullptr) {
+      throw std::runtime_error("Failed to get keyboard names.");
+    }
+
+    q.round_trips++;
+    if (XkbGetControls(display, XkbGroupsWrapMask, desc) != Success ||
+        desc->ctrls == nullptr) {
+      throw std::runtime_error("Failed to get keyboard controls.");
+    }
+
+    int num_groups = std::min<int>(desc->ctrls->num_groups, XkbNumKbdGroups);
+
+    // Resolve all atoms with a single request. Unnamed groups get empty names.
+    Atom atoms[XkbNumKbdGroups];
+    int index[XkbNumKbdGroups];
+    XGetAtomNamesWrapper names;
+    for (int group = 0; group < num_groups; group++) {
+      Atom atom = desc->names->groups[group];
+      index[group] = -1;
+      if (atom != None) {
+        index[group] = names.count;
+        atoms[names.count++] = atom;
+      }
+    }
+
+    // XGetAtomNames pipelines its requests and waits for the replies once
+    if (names.count > 0) {
+      q.round_trips++;
+      if (!XGetAtomNames(display, atoms, names.count, names.names)) {
+        throw std::runtime_error("Failed to get group name.");
+      }
+    }
+
+    q.names.clear();
+    for (int group = 0; group < num_groups; group++) {
+      const char* name = index[group] >= 0 ? names.names[index[group]] : nullptr;
+      q.names.push_back(name ? name : "");
+    }
+  }
+};
+
+XBackend* make_xlib_backend(const XKeyboard& xkb)
+{
+  return new XlibBackend(xkb);
+}
+
+}
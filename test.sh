@@ -60,6 +60,18 @@ done
 not "$X" -s fooo  # Sets non-zero error code
 $X --fancy        # Fancy name
 test "$($X --fancy)" != "$($X -p)"
+test "$($X --list --fancy | head -n 1)" != "$($X --list | head -n 1)"
+not "$X" --wait --timeout 100  # Times out with a non-zero code
+
+# Batch commands are pipelined: more switches cost no more round trips
+batch_round_trips() {
+  printf "$1" | "$X" --batch --stats 2>&1 >/dev/null |
+    sed -n 's/^total requests=[0-9]* round_trips=\([0-9]*\).*/\1/p'
+}
+L=$($X -l | head -n 1)
+test -n "$(batch_round_trips "set $L\n")"
+test "$(batch_round_trips "set $L\n")" = \
+     "$(batch_round_trips "set $L\nnext\nnext\nset $L\nnext\nset $L\n")"
 
 cat >/tmp/vimxkbswitch <<EOF
 let g:XkbSwitchLib = "$LIB"
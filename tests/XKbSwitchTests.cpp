@@ -0,0 +1,522 @@
+/*
+ * Copyright (C) 2010-2026 by Sergei Mironov
+ *
+ * This file is part of Xkb-switch.
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/** Unit tests run without an X server on the simulated XKB backend, and
+ * the replay of recorded event logs */
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "FakeBackend.hpp"
+#include "LayoutTable.hpp"
+#include "StatusShm.hpp"
+#include "Stream.hpp"
+#include "TextConverter.hpp"
+#include "WindowMemory.hpp"
+#include "WindowRules.hpp"
+#include "Writer.hpp"
+#include "Utils.hpp"
+
+using namespace std;
+using namespace kb;
+
+namespace {
+
+int failures = 0;
+
+#define EXPECT(x) do { \
+  if(!(x)) { \
+    cerr << __FILE__ << ":" << __LINE__ << ": failed: " #x << endl; \
+    failures++; \
+  } \
+} while(0)
+
+bool same(const char* a, const char* b)
+{
+  return a != NULL && b != NULL && string(a) == b;
+}
+
+// Returns what was written to the pipe so far
+string drain(int fd)
+{
+  string data;
+  char buf[4096];
+  ssize_t n;
+  while((n = ::read(fd, buf, sizeof(buf))) > 0)
+    data.append(buf, n);
+  return data;
+}
+
+// Pipe with a non-blocking read end
+struct test_pipe {
+  int fds[2];
+
+  test_pipe()
+  {
+    if(pipe2(fds, O_CLOEXEC) != 0)
+      throw std::runtime_error("pipe2() failed");
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  }
+
+  ~test_pipe()
+  {
+    close(fds[0]);
+    close(fds[1]);
+  }
+};
+
+// Keyboard on a FakeBackend with two groups, the second one current
+FakeBackend* open_fake(XKeyboard& xkb)
+{
+  FakeBackend* fake = new FakeBackend();
+  fake->_group = 1;
+  fake->_lv = make_pair(string("us,ru"), string(",phonetic"));
+  fake->_names.push_back("English (US)");
+  fake->_names.push_back("Russian (phonetic)");
+  xkb.open_backend(fake);
+  return fake;
+}
+
+void test_layout_table()
+{
+  LayoutTable t(make_pair(string("us,ru,de"), string(",phonetic,neo")));
+  EXPECT(t.size() == 3);
+  EXPECT(same(t.name(0), "us"));
+  EXPECT(same(t.name(1), "ru(phonetic)"));
+  EXPECT(same(t.name(2), "de(neo)"));
+  EXPECT(t.name(3) == NULL);
+  EXPECT(t.name(-1) == NULL);
+
+  EXPECT(t.find("ru(phonetic)") == 1);
+  EXPECT(t.find("ru") == -1);
+  EXPECT(t.find_layout("ru") == 1);
+  EXPECT(t.find_layout("fr") == -1);
+  EXPECT(t.lookup("de") == 2);
+  EXPECT(t.lookup("de(neo)") == 2);
+  EXPECT(t.lookup("de(nodeadkeys)") == -1);
+  EXPECT(t.lookup("") == -1);
+
+  string_vector v = t.to_vector();
+  EXPECT(v.size() == 3 && v[0] == "us" && v[1] == "ru(phonetic)" && v[2] == "de(neo)");
+
+  // The exact name wins over the first group of the layout
+  LayoutTable twice(make_pair(string("ru,ru"), string("phonetic,")));
+  EXPECT(twice.lookup("ru") == 1);
+  EXPECT(twice.lookup("ru(phonetic)") == 0);
+
+  // Empty layouts are skipped, groups beyond the capacity are dropped
+  LayoutTable gaps(make_pair(string("us,,fr"), string("")));
+  EXPECT(gaps.size() == 2 && same(gaps.name(1), "fr"));
+  LayoutTable many(make_pair(string("us,ru,de,fr,ua"), string("")));
+  EXPECT(many.size() == LayoutTable::CAPACITY);
+
+  EXPECT(LayoutTable().empty());
+  EXPECT(t == LayoutTable(make_pair(string("us,ru,de"), string(",phonetic,neo"))));
+  EXPECT(t != LayoutTable(make_pair(string("us,ru,de"), string(",,neo"))));
+
+  bool thrown = false;
+  try {
+    LayoutTable(make_pair(string(300, 'x'), string("")));
+  }
+  catch(std::runtime_error&) {
+    thrown = true;
+  }
+  EXPECT(thrown);
+}
+
+void test_glob_set()
+{
+  GlobSet g;
+  g.add("*term*");
+  g.add("Fire?ox");
+  g.add("[Tt]elegram*");
+  g.add("[!a-z]*");
+  g.add("a\\*b");
+
+  EXPECT(g._count == 5);
+  EXPECT(g.match("xterm") == 0);
+  EXPECT(g.match("terminal") == 0);
+  EXPECT(g.match("Firefox") == 1);
+  EXPECT(g.match("Firefox-esr") == 3);
+  EXPECT(g.match("telegram-desktop") == 2);
+  EXPECT(g.match("TelegramDesktop") == 2);
+  EXPECT(g.match("Code") == 3);
+  EXPECT(g.match("a*b") == 4);
+  EXPECT(g.match("axb") == -1);
+  EXPECT(g.match("code") == -1);
+  EXPECT(g.match("") == -1);
+
+  GlobSet all;
+  all.add("*");
+  EXPECT(all.match("") == 0);
+  EXPECT(all.match("anything") == 0);
+
+  // Patterns longer than a word of the automaton
+  GlobSet longer;
+  longer.add(string(70, '?'));
+  longer.add(string(65, 'a') + "*");
+  EXPECT(longer.match(string(70, 'b')) == 0);
+  EXPECT(longer.match(string(69, 'b')) == -1);
+  EXPECT(longer.match(string(66, 'a')) == 1);
+
+  bool thrown = false;
+  try {
+    g.add("[abc");
+  }
+  catch(std::runtime_error&) {
+    thrown = true;
+  }
+  EXPECT(thrown);
+}
+
+void observe_group(const XKeyboard& xkb, const XEvent&, event_kind, void* arg)
+{
+  *static_cast<int*>(arg) = xkb.group();
+}
+
+void test_fake_keyboard()
+{
+  XKeyboard xkb(0);
+  FakeBackend* fake = open_fake(xkb);
+  EXPECT(fake->_queries == 1);
+  EXPECT(xkb.get_group() == 1);
+
+  // The names are fetched once and then served from the cache
+  EXPECT(same(xkb.layout_table().name(1), "ru(phonetic)"));
+  EXPECT(xkb.group_names().size() == 2 && xkb.group_names()[1] == "Russian (phonetic)");
+  unsigned long queries = fake->_queries;
+  EXPECT(xkb.layout_table().size() == 2);
+  EXPECT(xkb.group_names()[0] == "English (US)");
+  EXPECT(xkb.get_group() == 1);
+  EXPECT(fake->_queries == queries);
+
+  // State events update the group without a query
+  fake->_group = 0;
+  EXPECT(xkb.handle_event(make_event(xkb, EVENT_STATE, 10, 0)) == EVENT_STATE);
+  EXPECT(xkb.get_group() == 0);
+  EXPECT(same(xkb.layout_table().name(0), "us"));
+  EXPECT(fake->_queries == queries);
+
+  // Rules, names and keymap events invalidate the names
+  fake->_lv = make_pair(string("us,de"), string(",neo"));
+  fake->_names[1] = "German (Neo 2)";
+  unsigned long generation = xkb.generation();
+  EXPECT(xkb.handle_event(make_event(xkb, EVENT_RULES, 20)) == EVENT_RULES);
+  EXPECT(xkb.generation() == generation + 1 && xkb.event_time() == 20);
+  EXPECT(!xkb.layout_valid());
+  EXPECT(same(xkb.layout_table().name(1), "de(neo)"));
+  EXPECT(xkb.group_names()[1] == "German (Neo 2)");
+  EXPECT(fake->_queries == queries + 2);
+
+  fake->_names[1] = "German";
+  EXPECT(xkb.handle_event(make_event(xkb, EVENT_NAMES, 30)) == EVENT_NAMES);
+  EXPECT(xkb.group_names()[1] == "German");
+  EXPECT(fake->_queries == queries + 3);
+
+  fake->_lv = make_pair(string("us,de,fr"), string(",neo,"));
+  EXPECT(xkb.handle_event(make_event(xkb, EVENT_KEYMAP, 40)) == EVENT_KEYMAP);
+  EXPECT(xkb.layout_table().size() == 3);
+  EXPECT(fake->_queries == queries + 4);
+
+  XEvent other;
+  std::memset(&other, 0, sizeof(other));
+  other.type = KeyPress;
+  EXPECT(xkb.handle_event(other) == EVENT_NONE);
+
+  // The observer sees the keyboard events after the cache is updated
+  int observed = -1;
+  xkb.set_observer(observe_group, &observed);
+  xkb.handle_event(make_event(xkb, EVENT_STATE, 50, 2));
+  xkb.handle_event(other);
+  EXPECT(observed == 2 && xkb.group() == 2);
+  xkb.set_observer(NULL, NULL);
+  xkb.handle_event(make_event(xkb, EVENT_STATE, 60, 1));
+  EXPECT(observed == 2 && xkb.group() == 1);
+}
+
+void test_group_stream()
+{
+  XKeyboard xkb(0);
+  FakeBackend* fake = open_fake(xkb);
+  test_pipe p;
+  Writer out(p.fds[1], 1, 0);
+
+  // The text format skips the initial state and repeated groups
+  GroupStream text(FORMAT_TEXT, 0, "", "", 0);
+  text.update(xkb, xkb.get_group(), out);
+  EXPECT(drain(p.fds[0]).empty());
+  xkb.handle_event(make_event(xkb, EVENT_STATE, 10, 0));
+  text.update(xkb, xkb.get_group(), out);
+  text.update(xkb, xkb.get_group(), out);
+  EXPECT(drain(p.fds[0]) == "us\n");
+
+  // A renamed current group is reported again
+  fake->_lv = make_pair(string("de,ru"), string(""));
+  xkb.handle_event(make_event(xkb, EVENT_RULES, 20));
+  text.update(xkb, xkb.get_group(), out);
+  EXPECT(drain(p.fds[0]) == "de\n");
+
+  GroupStream fancy(FORMAT_TEXT, 1, "tag\t", "", 0);
+  fancy.update(xkb, 0, out);
+  fancy.update(xkb, 1, out);
+  EXPECT(drain(p.fds[0]) == "tag\tRussian (phonetic)\n");
+
+  GroupStream json(FORMAT_JSONL, 0, "", ",\"display\":\":1\"", 0);
+  json.update(xkb, 0, out);
+  xkb.handle_event(make_event(xkb, EVENT_STATE, 30, 1));
+  json.update(xkb, xkb.get_group(), out);
+  EXPECT(drain(p.fds[0]) ==
+      "{\"time\":20,\"display\":\":1\",\"prev_group\":-1,\"group\":0,\"name\":\"de\",\"fancy\":\"English (US)\"}\n"
+      "{\"time\":30,\"display\":\":1\",\"prev_group\":0,\"group\":1,\"name\":\"ru\",\"fancy\":\"Russian (phonetic)\"}\n");
+
+  GroupStream binary(FORMAT_BINARY, 0, "", "", 0);
+  binary.update(xkb, 1, out);
+  string data = drain(p.fds[0]);
+  EXPECT(data.size() == sizeof(stream_record));
+  if(data.size() == sizeof(stream_record)) {
+    stream_record r;
+    std::memcpy(&r, data.data(), sizeof(r));
+    EXPECT(r.magic == STREAM_RECORD_MAGIC && r.group == 1 && r.prev_group == -1);
+    EXPECT(string(r.name) == "ru" && string(r.fancy) == "Russian (phonetic)");
+  }
+}
+
+void test_group_history()
+{
+  XKeyboard xkb(0);
+  FakeBackend* fake = open_fake(xkb);
+  fake->_history.count = 2;
+  fake->_history.groups[0] = 1;
+  fake->_history.groups[1] = 0;
+
+  // The history is read once, then kept until another client changes it
+  unsigned long queries = fake->_queries;
+  EXPECT(xkb.history().count == 2 && xkb.history().groups[1] == 0);
+  EXPECT(fake->_queries == queries + 1);
+  xkb.handle_event(make_event(xkb, EVENT_STATE, 10, 0));
+  EXPECT(xkb.history().groups[0] == 1);
+  EXPECT(fake->_queries == queries + 1);
+}
+
+void test_writer()
+{
+  test_pipe p;
+  {
+    Writer out(p.fds[1], 2, 0);
+    out.write("a");
+    out.end_record();
+    EXPECT(drain(p.fds[0]).empty());
+    out.write("b");
+    out.end_record();
+    EXPECT(drain(p.fds[0]) == "ab");
+    out.write("c");
+  }
+  // The rest is flushed by the destructor
+  EXPECT(drain(p.fds[0]) == "c");
+
+  Writer buffered(p.fds[1], 0, 0);
+  for(int i=0; i<100; i++) {
+    buffered.write("x");
+    buffered.end_record();
+  }
+  EXPECT(drain(p.fds[0]).empty());
+  buffered.flush();
+  EXPECT(drain(p.fds[0]) == string(100, 'x'));
+
+  // Records larger than the buffer go out whole
+  Writer large(p.fds[1], 1, 0);
+  large.write("z");
+  large.write(string(10000, 'y'));
+  large.end_record();
+  EXPECT(drain(p.fds[0]) == "z" + string(10000, 'y'));
+}
+
+void test_text_converter()
+{
+  vector<pair<uint32_t, uint32_t> > pairs;
+  pairs.push_back(make_pair(uint32_t('q'), uint32_t(0x439)));   // й
+  pairs.push_back(make_pair(uint32_t('Q'), uint32_t(0x419)));   // Й
+  pairs.push_back(make_pair(uint32_t(0x3b1), uint32_t('a')));   // α
+  pairs.push_back(make_pair(uint32_t(0x20ac), uint32_t('$')));  // €
+  TextConverter c;
+  c.build(pairs);
+
+  char out[64];
+  string in = "qQ x qqqqqqqq";
+  string converted(out, c.convert(in.data(), in.size(), out, NULL));
+  EXPECT(converted == "\xd0\xb9\xd0\x99 x \xd0\xb9\xd0\xb9\xd0\xb9\xd0\xb9"
+                      "\xd0\xb9\xd0\xb9\xd0\xb9\xd0\xb9");
+
+  in = "\xce\xb1\xe2\x82\xac\xce\xb2";
+  converted.assign(out, c.convert(in.data(), in.size(), out, NULL));
+  EXPECT(converted == "a$\xce\xb2");
+
+  // An incomplete sequence is left for the next call or copied
+  in = "q\xd0";
+  size_t consumed = 0;
+  converted.assign(out, c.convert(in.data(), in.size(), out, &consumed));
+  EXPECT(converted == "\xd0\xb9" && consumed == 1);
+  converted.assign(out, c.convert(in.data(), in.size(), out, NULL));
+  EXPECT(converted == "\xd0\xb9\xd0");
+
+  // Stray continuation bytes are copied
+  in = "\x80q";
+  converted.assign(out, c.convert(in.data(), in.size(), out, NULL));
+  EXPECT(converted == "\x80\xd0\xb9");
+}
+
+// Reads the status in a child process, since the lock of the publisher
+// doesn't show up in its own process. Returns the exit code of the child.
+int read_status_child(const string& path, int group, const char* name)
+{
+  pid_t pid = fork();
+  if(pid == 0) {
+    StatusReader reader;
+    shm_status status;
+    if(!reader.open(path))
+      _exit(2);
+    if(!reader.read(status))
+      _exit(3);
+    _exit(status.group == group && string(status.name) == name &&
+          string(status.layouts) == "us ru(phonetic)" && status.count == 2 ? 0 : 4);
+  }
+  int status = -1;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+void test_status_shm()
+{
+  char path[] = "/tmp/xkb-switch-tests.XXXXXX";
+  int fd = mkstemp(path);
+  EXPECT(fd >= 0);
+  if(fd < 0)
+    return;
+  close(fd);
+
+  XKeyboard xkb(0);
+  open_fake(xkb);
+  {
+    StatusPublisher publisher(path, 0);
+    publisher.publish(xkb, 1);
+    EXPECT(publisher._status->generation == 1);
+    EXPECT(read_status_child(path, 1, "ru(phonetic)") == 0);
+
+    // Unchanged groups are not published again
+    publisher.publish(xkb, 1);
+    EXPECT(publisher._status->generation == 1);
+    publisher.publish(xkb, 0);
+    EXPECT(publisher._status->generation == 2 && publisher._status->seq % 2 == 0);
+    EXPECT(read_status_child(path, 0, "us") == 0);
+
+    // Readers never copy the data while the sequence is odd
+    publisher._status->seq++;
+    EXPECT(read_status_child(path, 0, "us") == 3);
+    publisher._status->seq++;
+    EXPECT(read_status_child(path, 0, "us") == 0);
+  }
+  // Without a publisher the file is stale
+  EXPECT(read_status_child(path, 0, "us") == 3);
+  unlink(path);
+}
+
+void test_window_memory()
+{
+  WindowMemory m(2);
+  int group = -1;
+  EXPECT(m.put(1, 0) == None);
+  EXPECT(m.put(2, 1) == None);
+  EXPECT(m.get(1, group) && group == 0);
+
+  // Window 2 is the least recently used one now
+  EXPECT(m.put(3, 1) == 2);
+  EXPECT(!m.get(2, group));
+  EXPECT(m.put(1, 1) == None);
+  EXPECT(m.get(1, group) && group == 1);
+  EXPECT(m._lru.size() == 2 && m._index.size() == 2);
+
+  m.erase(1);
+  m.erase(5);
+  EXPECT(!m.get(1, group));
+  EXPECT(m.get(3, group) && group == 1);
+  EXPECT(m._lru.size() == 1 && m._index.size() == 1);
+}
+
+// Prints what -W would print for the recorded events
+int replay(const char* path, const char* format)
+{
+  ifstream in(path);
+  if(!in) {
+    cerr << "Failed to open " << path << endl;
+    return 1;
+  }
+  event_log log;
+  read_event_log(in, log, 0);
+  Writer out(STDOUT_FILENO, 0, 0);
+  replay_events(log, parse_stream_format(format, 0), 0, out, 0);
+  out.flush();
+  return 0;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+  try {
+    if(argc > 1) {
+      if(!((argc == 3 || argc == 4) && string(argv[1]) == "--replay")) {
+        cerr << "Usage: xkb-switch-tests [--replay FILE [FORMAT]]" << endl;
+        return 2;
+      }
+      return replay(argv[2], argc == 4 ? argv[3] : "text");
+    }
+
+    test_layout_table();
+    test_glob_set();
+    test_fake_keyboard();
+    test_group_stream();
+    test_group_history();
+    test_writer();
+    test_text_converter();
+    test_status_shm();
+    test_window_memory();
+  }
+  catch(std::exception& err) {
+    cerr << err.what() << endl;
+    return 1;
+  }
+  if(failures > 0) {
+    cerr << failures << " checks failed" << endl;
+    return 1;
+  }
+  return 0;
+}
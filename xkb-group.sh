@@ -58,12 +58,12 @@ while read event arg <$FIFO ; do
 			esac
 			;;
 		user-asks-switch)
-			$XKBS -s "$next" ;;
+			echo "set $next" ;;
 		*)
 			echo "unknown command: $event $arg" >&2
 			;;
 	esac
-done &
+done | $XKBS --batch >/dev/null &
 
 echo layout-change `$XKBS -p` >$FIFO
 $XKBS -W | while read l ;do